@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = changebench
+
+include(../common/common.pri)
+
+SOURCES += \
+    main.cpp
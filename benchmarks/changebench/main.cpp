@@ -0,0 +1,350 @@
+#include "syntheticmodel.h"
+#include "plugin.h"
+#include "flexview_p.h"
+#include "flexsection.h"
+#include "flextrace.h"
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QQmlContext>
+#include <QQuickView>
+#include <QRandomGenerator>
+#include <QSGRendererInterface>
+#include <QTextStream>
+#include <QtQuick/private/qquickwindow_p.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// changebench drives streams of inserts, removes, changes and moves through a real model into a
+// FlexView, and measures FlexViewPrivate::applyPendingChanges() and the following layout.
+// After every batch (or every --check-every batches) the view is compared against the model
+// and a layout from scratch with FlexViewPrivate::validateLayout().
+
+namespace {
+
+qint64 percentile(QVector<qint64> values, qreal p)
+{
+    if (values.isEmpty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    int i = std::clamp(int(std::ceil(p * values.size())) - 1, 0, int(values.size()) - 1);
+    return values[i];
+}
+
+class ChangeStream
+{
+public:
+    ChangeStream(SyntheticModel *model, quint32 seed, int maxCount)
+        : m_model(model)
+        , m_random(seed)
+        , m_maxCount(std::max(maxCount, 1))
+    {
+    }
+
+    QStringList log;
+
+    // Uniformly random positions and sizes, with sections mostly extending their neighbours
+    void random()
+    {
+        int rows = m_model->rowCount();
+        int op = m_random.bounded(4);
+        if (rows < 2)
+            op = 0;
+
+        if (op == 0) {
+            int row = m_random.bounded(rows + 1);
+            insert(row, count(), neighbourOrNew(row));
+        } else if (op == 1) {
+            int row = m_random.bounded(rows);
+            remove(row, std::min(count(), rows - row));
+        } else if (op == 3) {
+            int row = m_random.bounded(rows);
+            int n = std::min(count(), rows - row);
+            move(row, n, m_random.bounded(rows + 1));
+        } else {
+            int row = m_random.bounded(rows);
+            int n = std::min(count(), rows - row);
+            int roll = m_random.bounded(10);
+            int section = m_model->sectionAt(row);
+            if (roll >= 5)
+                section = roll >= 8 ? m_model->newSection() : neighbourOrNew(row);
+            change(row, n, section);
+        }
+    }
+
+    // Changes aimed at section boundaries, splits and merges
+    void adversarial()
+    {
+        int rows = m_model->rowCount();
+        if (rows < 4) {
+            insert(0, 4, m_model->newSection());
+            return;
+        }
+
+        int row = m_random.bounded(rows);
+        auto [first, last] = sectionRange(row);
+
+        switch (m_random.bounded(10)) {
+        case 0:
+            // Insert at a section boundary with the previous section's value
+            insert(first, count(), first > 0 ? m_model->sectionAt(first - 1) : m_model->newSection());
+            break;
+        case 1:
+            // Insert a new section into the middle of a section
+            insert(first + (last - first) / 2, count(), m_model->newSection());
+            break;
+        case 2:
+            // Remove a whole section, joining its neighbours
+            remove(first, last - first + 1);
+            break;
+        case 3:
+            // Remove across a section boundary
+            if (last + 1 < rows)
+                remove(std::max(first, last - 2), std::min(rows - 1, last + 2) - std::max(first, last - 2) + 1);
+            break;
+        case 4:
+            // Change a whole section to the previous section's value, merging them
+            if (first > 0)
+                change(first, last - first + 1, m_model->sectionAt(first - 1));
+            break;
+        case 5:
+            // Flip alternating rows to a new section, then restore them
+            {
+                int section = m_model->sectionAt(row);
+                int other = m_model->newSection();
+                int end = std::min(last, first + 16);
+                for (int i = first; i <= end; i += 2)
+                    change(i, 1, other);
+                for (int i = first; i <= end; i += 2)
+                    change(i, 1, section);
+            }
+            break;
+        case 6:
+            // Burst of single row inserts at the head
+            for (int i = 0; i < m_maxCount; i++)
+                insert(0, 1, m_model->sectionAt(0));
+            break;
+        case 7:
+            // Remove from the head
+            remove(0, std::min(count(), rows - 1));
+            break;
+        case 8:
+            // Drag a few rows to another place in the same section
+            if (last > first)
+                move(row, std::min(count(), last - row + 1), first + m_random.bounded(last - first + 2));
+            break;
+        case 9:
+            // Move a whole section somewhere else, possibly into the middle of another
+            move(first, last - first + 1, m_random.bounded(rows + 1));
+            break;
+        }
+    }
+
+private:
+    SyntheticModel *m_model;
+    QRandomGenerator m_random;
+    int m_maxCount;
+
+    int count()
+    {
+        // Mostly small changes, occasionally large ones
+        int n = 1 + m_random.bounded(m_maxCount);
+        if (m_random.bounded(10) == 0)
+            n *= 10;
+        return n;
+    }
+
+    int neighbourOrNew(int row)
+    {
+        int rows = m_model->rowCount();
+        switch (m_random.bounded(5)) {
+        case 0:
+            return m_model->newSection();
+        case 1:
+            if (row < rows)
+                return m_model->sectionAt(row);
+            break;
+        }
+        if (row > 0)
+            return m_model->sectionAt(row - 1);
+        return rows ? m_model->sectionAt(0) : m_model->newSection();
+    }
+
+    std::pair<int, int> sectionRange(int row)
+    {
+        int section = m_model->sectionAt(row);
+        int first = row, last = row;
+        while (first > 0 && m_model->sectionAt(first - 1) == section)
+            first--;
+        while (last + 1 < m_model->rowCount() && m_model->sectionAt(last + 1) == section)
+            last++;
+        return {first, last};
+    }
+
+    void insert(int row, int n, int section)
+    {
+        log.append(QString("insert %1 count %2 section %3").arg(row).arg(n).arg(section));
+        m_model->insertItems(row, n, section);
+    }
+
+    void remove(int row, int n)
+    {
+        if (n < 1)
+            return;
+        log.append(QString("remove %1 count %2").arg(row).arg(n));
+        m_model->removeItems(row, n);
+    }
+
+    // Destinations inside the moved rows are no-ops, and are skipped
+    void move(int row, int n, int destination)
+    {
+        if (n < 1 || (destination >= row && destination <= row + n))
+            return;
+        log.append(QString("move %1 count %2 to %3").arg(row).arg(n).arg(destination));
+        m_model->moveItems(row, n, destination);
+    }
+
+    void change(int row, int n, int section)
+    {
+        log.append(QString("change %1 count %2 section %3").arg(row).arg(n).arg(section));
+        m_model->changeItems(row, n, section);
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    if (!qEnvironmentVariableIsSet("QT_QUICK_BACKEND"))
+        QQuickWindow::setSceneGraphBackend(QSGRendererInterface::Software);
+
+    QGuiApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("FlexView change-set throughput benchmark and differential check");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"rows", "Initial model rows", "count", "20000"},
+        {"section-length", "Mean items per section, 0 for no sections", "count", "40"},
+        {"ratios", "Ratio distribution: square, camera, mixed, panorama", "name", "mixed"},
+        {"seed", "Seed for the model and change stream", "seed", "1"},
+        {"batches", "Number of change batches", "count", "2000"},
+        {"batch-size", "Changes per batch", "count", "8"},
+        {"max-count", "Maximum rows per change", "count", "8"},
+        {"mode", "Change stream: random, adversarial, mixed", "mode", "mixed"},
+        {"check-every", "Validate after every n batches, 0 to disable", "n", "1"},
+        {"update-budget", "FlexView updateBudget in ms, 0 for unlimited", "ms", "0"},
+        {"trace", "Write trace events to file", "file"},
+    });
+    parser.process(app);
+
+    SyntheticModel::Options options;
+    options.count = std::max(parser.value("rows").toInt(), 1);
+    options.sectionLength = parser.value("section-length").toInt();
+    options.seed = parser.value("seed").toUInt();
+    if (!SyntheticModel::parseRatios(parser.value("ratios"), &options.ratios)) {
+        qCritical() << "Unknown ratio distribution" << parser.value("ratios");
+        return 1;
+    }
+
+    QString mode = parser.value("mode");
+    if (mode != "random" && mode != "adversarial" && mode != "mixed") {
+        qCritical() << "Unknown mode" << mode;
+        return 1;
+    }
+    int batches = parser.value("batches").toInt();
+    int batchSize = std::max(parser.value("batch-size").toInt(), 1);
+    int checkEvery = parser.value("check-every").toInt();
+
+    if (parser.isSet("trace"))
+        FlexTrace::start(parser.value("trace"));
+
+    QuickViewsPlugin().registerTypes("Crimson.Views");
+
+    SyntheticModel model(options);
+    QQuickView window;
+    window.setResizeMode(QQuickView::SizeRootObjectToView);
+    window.rootContext()->setContextProperty("benchModel", &model);
+    window.rootContext()->setContextProperty("benchSectionRole", QString(options.sectionLength > 0 ? "section" : ""));
+    window.rootContext()->setContextProperty("benchIdealHeight", 120.);
+    window.rootContext()->setContextProperty("benchCacheBuffer", 400.);
+    window.setSource(QUrl("qrc:/benchview.qml"));
+
+    FlexView *view = qobject_cast<FlexView*>(window.rootObject());
+    if (!view) {
+        qCritical() << "Failed to load FlexView:" << window.errors();
+        return 1;
+    }
+    view->setUpdateBudget(parser.value("update-budget").toInt());
+    window.resize(1024, 768);
+    window.show();
+
+    FlexViewPrivate *d = FlexViewPrivate::get(view);
+    QQuickWindowPrivate *wd = QQuickWindowPrivate::get(&window);
+    wd->polishItems();
+
+    ChangeStream stream(&model, options.seed, parser.value("max-count").toInt());
+    QRandomGenerator scrollRandom(options.seed ^ 0x5c011u);
+    QVector<qint64> applyNsecs;
+    QVector<qint64> layoutNsecs;
+    qint64 changes = 0;
+    int failures = 0;
+
+    QTextStream out(stdout);
+    for (int b = 0; b < batches; b++) {
+        stream.log.clear();
+        for (int i = 0; i < batchSize; i++) {
+            bool adversarial = mode == "adversarial" || (mode == "mixed" && (b + i) % 2);
+            if (adversarial)
+                stream.adversarial();
+            else
+                stream.random();
+        }
+        changes += stream.log.size();
+
+        QElapsedTimer tm;
+        tm.start();
+        d->applyPendingChanges();
+        applyNsecs.append(tm.nsecsElapsed());
+
+        // Move around occasionally, so changes land above, in and below the laid out area
+        if (b % 16 == 0)
+            view->setContentY(view->originY() + scrollRandom.bounded(std::max(1., view->contentHeight() - view->height())));
+
+        tm.restart();
+        wd->polishItems();
+        layoutNsecs.append(tm.nsecsElapsed());
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+
+        if (checkEvery > 0 && (b % checkEvery == 0 || b == batches - 1) && !d->validateLayout()) {
+            failures++;
+            out << "batch " << b << " failed validation after:\n";
+            for (const QString &line : stream.log)
+                out << "    " << line << "\n";
+            out.flush();
+            if (failures >= 10)
+                break;
+        }
+    }
+
+    auto us = [](qint64 ns) { return QString::number(ns / 1e3, 'f', 1); };
+    qint64 applyTotal = std::accumulate(applyNsecs.begin(), applyNsecs.end(), qint64(0));
+    qint64 layoutTotal = std::accumulate(layoutNsecs.begin(), layoutNsecs.end(), qint64(0));
+
+    out << "changebench: " << mode << ", " << applyNsecs.size() << " batches of " << batchSize
+        << ", " << changes << " changes, " << model.rowCount() << " rows and "
+        << d->sections.size() << " sections at the end\n\n";
+    out << "applyPendingChanges per batch: p50 " << us(percentile(applyNsecs, 0.5)) << " us, p90 "
+        << us(percentile(applyNsecs, 0.9)) << " us, p99 " << us(percentile(applyNsecs, 0.99))
+        << " us, max " << us(percentile(applyNsecs, 1)) << " us\n";
+    out << "applyPendingChanges per change: " << us(changes ? applyTotal / changes : 0) << " us\n";
+    out << "layout per batch: p50 " << us(percentile(layoutNsecs, 0.5)) << " us, p90 "
+        << us(percentile(layoutNsecs, 0.9)) << " us, p99 " << us(percentile(layoutNsecs, 0.99))
+        << " us, max " << us(percentile(layoutNsecs, 1)) << " us, total " << us(layoutTotal) << " us\n";
+    out << "validation: " << (checkEvery > 0 ? (failures ? QString("%1 failures").arg(failures) : QString("passed")) : QString("disabled")) << "\n";
+
+    FlexTrace::stop();
+    return failures ? 1 : 0;
+}
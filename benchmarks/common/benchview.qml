@@ -0,0 +1,44 @@
+import QtQuick 2.12
+import Crimson.Views 1.0
+
+FlexView {
+    id: view
+
+    model: benchModel
+    sectionRole: benchSectionRole
+    sizeRole: "ratio"
+    idealHeight: benchIdealHeight
+    cacheBuffer: benchCacheBuffer
+    horizontalSpacing: 2
+    verticalSpacing: 2
+    sectionSpacing: 8
+
+    delegate: Rectangle {
+        color: index % 2 ? "#6d7f8f" : "#7f6d8f"
+
+        Rectangle {
+            anchors.fill: parent
+            anchors.margins: 4
+            color: "transparent"
+            border.width: 1
+            border.color: "white"
+        }
+    }
+
+    section: Item {
+        height: header.height + content.height
+
+        Rectangle {
+            id: header
+            width: parent.width
+            height: 32
+            color: "#303030"
+        }
+
+        Item {
+            id: content
+            y: header.height
+            FlexSection.contentItem: content
+        }
+    }
+}
@@ -0,0 +1,19 @@
+# Benchmarks build the plugin sources in directly, so they can register Crimson.Views
+# in-process and reach private API without installing the plugin.
+
+QT += qml quick qml-private quick-private
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+include($$PWD/../../src/src.pri)
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/syntheticmodel.cpp
+
+HEADERS += \
+    $$PWD/syntheticmodel.h
+
+RESOURCES += \
+    $$PWD/common.qrc
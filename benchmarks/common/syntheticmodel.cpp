@@ -0,0 +1,172 @@
+#include "syntheticmodel.h"
+#include <algorithm>
+
+// Cheap, well-mixed hash for deterministic per-row values
+quint32 syntheticHash(quint32 value, quint32 seed)
+{
+    quint32 h = value * 0x9e3779b9u + seed;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+SyntheticModel::SyntheticModel(const Options &options, QObject *parent)
+    : QAbstractListModel(parent)
+    , m_options(options)
+{
+    int count = std::max(m_options.count, 0);
+    if (m_options.sectionLength < 1) {
+        m_sectionStarts.append(0);
+        m_nextSection = 1;
+        return;
+    }
+
+    int jitter = m_options.sectionLength * std::clamp(m_options.sectionJitter, 0., 1.);
+    for (int start = 0, s = 0; start < count; s++) {
+        m_sectionStarts.append(start);
+        int length = m_options.sectionLength;
+        if (jitter > 0)
+            length += int(syntheticHash(s, m_options.seed ^ 0x5ec7u) % (2 * jitter + 1)) - jitter;
+        start += std::max(length, 1);
+    }
+    m_nextSection = m_sectionStarts.size();
+}
+
+int SyntheticModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return m_materialized ? m_items.size() : m_options.count;
+}
+
+QHash<int, QByteArray> SyntheticModel::roleNames() const
+{
+    return {
+        {SectionRole, "section"},
+        {RatioRole, "ratio"},
+    };
+}
+
+QVariant SyntheticModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= rowCount())
+        return QVariant();
+
+    switch (role) {
+    case SectionRole:
+        return QStringLiteral("Section %1").arg(sectionAt(index.row()));
+    case RatioRole:
+        return m_materialized ? qreal(m_items[index.row()].ratio) : ratioOf(index.row());
+    }
+    return QVariant();
+}
+
+int SyntheticModel::sectionOf(int row) const
+{
+    auto it = std::upper_bound(m_sectionStarts.begin(), m_sectionStarts.end(), row);
+    return std::distance(m_sectionStarts.begin(), it) - 1;
+}
+
+int SyntheticModel::sectionAt(int row) const
+{
+    return m_materialized ? m_items[row].section : sectionOf(row);
+}
+
+qreal SyntheticModel::ratioOf(int row) const
+{
+    return ratioFromHash(syntheticHash(row, m_options.seed));
+}
+
+qreal SyntheticModel::ratioFromHash(quint32 h) const
+{
+    qreal u = (h & 0xffff) / 65536.;
+    qreal v = (h >> 16) / 65536.;
+
+    switch (m_options.ratios) {
+    case Ratios::Square:
+        return 1;
+    case Ratios::Camera:
+        return u < 0.8 ? 3. / 2. : 2. / 3.;
+    case Ratios::Mixed:
+        return 0.5 + u * 1.5;
+    case Ratios::Panorama:
+        return u < 0.9 ? 4. / 3. : 2.5 + v * 1.5;
+    }
+    return 1;
+}
+
+void SyntheticModel::materialize()
+{
+    if (m_materialized)
+        return;
+    m_items.resize(m_options.count);
+    for (int i = 0; i < m_items.size(); i++)
+        m_items[i] = Item{sectionOf(i), float(ratioOf(i))};
+    m_materialized = true;
+}
+
+void SyntheticModel::insertItems(int row, int count, int section)
+{
+    materialize();
+    Q_ASSERT(row >= 0 && row <= m_items.size() && count > 0);
+    beginInsertRows(QModelIndex(), row, row + count - 1);
+    m_items.insert(row, count, Item{section, 1});
+    for (int i = row; i < row + count; i++)
+        m_items[i].ratio = ratioFromHash(syntheticHash(m_mutations++, ~m_options.seed));
+    endInsertRows();
+}
+
+void SyntheticModel::removeItems(int row, int count)
+{
+    materialize();
+    Q_ASSERT(row >= 0 && count > 0 && row + count <= m_items.size());
+    beginRemoveRows(QModelIndex(), row, row + count - 1);
+    m_items.remove(row, count);
+    endRemoveRows();
+}
+
+// Changes the section of rows to 'section', and gives them new ratios
+void SyntheticModel::changeItems(int row, int count, int section)
+{
+    materialize();
+    Q_ASSERT(row >= 0 && count > 0 && row + count <= m_items.size());
+    for (int i = row; i < row + count; i++)
+        m_items[i] = Item{section, float(ratioFromHash(syntheticHash(m_mutations++, ~m_options.seed)))};
+    emit dataChanged(index(row), index(row + count - 1));
+}
+
+// Moves rows to before 'destination', which is a row index from before the move as in
+// beginMoveRows, and must not be within the moved rows
+void SyntheticModel::moveItems(int row, int count, int destination)
+{
+    materialize();
+    Q_ASSERT(row >= 0 && count > 0 && row + count <= m_items.size());
+    Q_ASSERT(destination >= 0 && destination <= m_items.size());
+    Q_ASSERT(destination < row || destination > row + count);
+    if (!beginMoveRows(QModelIndex(), row, row + count - 1, QModelIndex(), destination))
+        return;
+    QVector<Item> moved = m_items.mid(row, count);
+    m_items.remove(row, count);
+    int to = destination > row ? destination - count : destination;
+    for (int i = 0; i < count; i++)
+        m_items.insert(to + i, moved[i]);
+    endMoveRows();
+}
+
+bool SyntheticModel::parseRatios(const QString &name, Ratios *ratios)
+{
+    static const QHash<QString, Ratios> names{
+        {"square", Ratios::Square},
+        {"camera", Ratios::Camera},
+        {"mixed", Ratios::Mixed},
+        {"panorama", Ratios::Panorama},
+    };
+    auto it = names.constFind(name.toLower());
+    if (it == names.constEnd())
+        return false;
+    *ratios = *it;
+    return true;
+}
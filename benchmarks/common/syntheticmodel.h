@@ -0,0 +1,76 @@
+#pragma once
+
+#include <QAbstractListModel>
+#include <QVector>
+
+// SyntheticModel generates rows from their index, so it can stand in for very large
+// photo libraries without storing anything per row. Section lengths vary around a mean,
+// and ratios follow one of a few distributions seen in real libraries.
+class SyntheticModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Roles
+    {
+        SectionRole = Qt::UserRole + 1,
+        RatioRole
+    };
+
+    enum class Ratios
+    {
+        Square,     // all 1:1
+        Camera,     // mostly 3:2 landscape, some 2:3 portrait
+        Mixed,      // uniform between 1:2 and 2:1
+        Panorama    // mostly 4:3, with occasional very wide images
+    };
+
+    struct Options
+    {
+        int count = 100000;
+        int sectionLength = 500; // mean items per section; 0 for one section
+        qreal sectionJitter = 0.5; // section lengths vary by up to this fraction
+        Ratios ratios = Ratios::Mixed;
+        quint32 seed = 1;
+    };
+
+    explicit SyntheticModel(const Options &options, QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    int sectionCount() const { return m_sectionStarts.size(); }
+
+    // Mutations store every row on first use, so they are meant for models of moderate
+    // size. Sections are identified by id and shown as "Section <id>".
+    int sectionAt(int row) const;
+    int newSection() { return m_nextSection++; }
+    void insertItems(int row, int count, int section);
+    void removeItems(int row, int count);
+    void changeItems(int row, int count, int section);
+    void moveItems(int row, int count, int destination);
+
+    static bool parseRatios(const QString &name, Ratios *ratios);
+
+private:
+    struct Item
+    {
+        int section;
+        float ratio;
+    };
+
+    Options m_options;
+    QVector<int> m_sectionStarts;
+    QVector<Item> m_items;
+    bool m_materialized = false;
+    int m_nextSection = 0;
+    quint32 m_mutations = 0;
+
+    int sectionOf(int row) const;
+    qreal ratioOf(int row) const;
+    qreal ratioFromHash(quint32 h) const;
+    void materialize();
+};
+
+quint32 syntheticHash(quint32 value, quint32 seed);
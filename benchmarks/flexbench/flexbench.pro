@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = flexbench
+
+include(../common/common.pri)
+
+SOURCES += \
+    main.cpp
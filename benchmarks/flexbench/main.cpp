@@ -0,0 +1,338 @@
+#include "syntheticmodel.h"
+#include "plugin.h"
+#include "flexview.h"
+#include "flexstats.h"
+#include "flextrace.h"
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QQmlContext>
+#include <QQuickView>
+#include <QSGRendererInterface>
+#include <QTextStream>
+#include <QtQuick/private/qquickwindow_p.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// flexbench drives a FlexView over a SyntheticModel through a scripted sequence of
+// scrolling, flicks, jumps, seeks, keyboard navigation and resizes. Every step is polished
+// synchronously, so the per-frame numbers are the cost of FlexView's polish (layout and
+// delegate creation), independent of vsync and the render loop.
+
+namespace {
+
+struct Phase
+{
+    QString name;
+    QVector<qint64> polishNsecs;
+    FlexViewStats::Counters start;
+    FlexViewStats::Counters end;
+};
+
+qint64 percentile(QVector<qint64> values, qreal p)
+{
+    if (values.isEmpty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    int i = std::clamp(int(std::ceil(p * values.size())) - 1, 0, int(values.size()) - 1);
+    return values[i];
+}
+
+qint64 peakMemoryKb()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return -1;
+}
+
+class Bench
+{
+public:
+    Bench(QQuickView *window, FlexView *view, bool render)
+        : m_window(window)
+        , m_view(view)
+        , m_render(render)
+    {
+    }
+
+    void begin(const QString &name)
+    {
+        m_phases.append(Phase{name, {}, m_view->stats()->totals(), {}});
+        m_timer.start();
+    }
+
+    void end()
+    {
+        Phase &phase = m_phases.last();
+        phase.end = m_view->stats()->totals();
+        m_wallNsecs += m_timer.nsecsElapsed();
+    }
+
+    void frame()
+    {
+        QElapsedTimer tm;
+        tm.start();
+        QQuickWindowPrivate::get(m_window)->polishItems();
+        m_phases.last().polishNsecs.append(tm.nsecsElapsed());
+
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+        if (m_render)
+            m_window->grabWindow();
+    }
+
+    // The view moves its origin to keep the visible rows in place as heights change
+    qreal minContentY() const
+    {
+        return m_view->originY();
+    }
+
+    qreal maxContentY() const
+    {
+        return std::max(minContentY(), minContentY() + m_view->contentHeight() - m_view->height());
+    }
+
+    void scrollTo(qreal y)
+    {
+        m_view->setContentY(std::clamp(y, minContentY(), maxContentY()));
+        frame();
+    }
+
+    void steady(int frames, qreal pixelsPerFrame)
+    {
+        begin("steady");
+        for (int i = 0; i < frames && m_view->contentY() < maxContentY(); i++)
+            scrollTo(m_view->contentY() + pixelsPerFrame);
+        end();
+    }
+
+    // Kinematic flick at 60fps, decelerating like Flickable's default
+    void flicks(int count, qreal velocity, qreal deceleration)
+    {
+        begin("flick");
+        for (int f = 0; f < count; f++) {
+            qreal v = (f % 2) ? -velocity : velocity;
+            while (std::abs(v) > 1) {
+                scrollTo(m_view->contentY() + v / 60);
+                v -= std::copysign(deceleration / 60, v);
+                if (std::abs(v) < deceleration / 60)
+                    break;
+            }
+        }
+        end();
+    }
+
+    void jumps(int count, int settleFrames)
+    {
+        begin("jump");
+        for (int j = 0; j < count; j++) {
+            scrollTo((j % 2) ? minContentY() : maxContentY());
+            for (int i = 0; i < settleFrames; i++)
+                scrollTo((j % 2) ? minContentY() : maxContentY());
+        }
+        end();
+    }
+
+    // positionViewAtIndex to indices spread over the model, like following deep links. The
+    // call itself is timed as a frame, followed by frames with the view at rest.
+    void seeks(int count, int settleFrames)
+    {
+        begin("seek");
+        int rows = m_view->model()->rowCount();
+        for (int j = 0; j < count; j++) {
+            QElapsedTimer tm;
+            tm.start();
+            m_view->positionViewAtIndex(int(syntheticHash(j, 0x5eeku) % rows), FlexView::Center);
+            m_phases.last().polishNsecs.append(tm.nsecsElapsed());
+            for (int i = 0; i < settleFrames; i++)
+                frame();
+        }
+        end();
+    }
+
+    // Keyboard navigation from the top: rows down, then pages down and back up. Each move is
+    // timed like a seek, followed by a frame that scrolls just enough to show the current item.
+    void keys(int rows, int pages)
+    {
+        begin("keys");
+        scrollTo(minContentY());
+        m_view->setCurrentIndex(0);
+        for (int i = 0; i < rows + 2 * pages; i++) {
+            QElapsedTimer tm;
+            tm.start();
+            if (i < rows)
+                m_view->moveCurrentRow(1);
+            else
+                m_view->movePage(i < rows + pages ? 1 : -1);
+            m_phases.last().polishNsecs.append(tm.nsecsElapsed());
+
+            QRectF geometry = m_view->geometryOf(m_view->currentIndex());
+            scrollTo(std::max(std::min(m_view->contentY(), geometry.top()), geometry.bottom() - m_view->height()));
+        }
+        end();
+    }
+
+    void resizes(int count)
+    {
+        begin("resize");
+        QSize size = m_window->size();
+        for (int i = 0; i < count; i++) {
+            m_window->resize((i % 2) ? size : QSize(size.width() * 3 / 4, size.height()));
+            frame();
+        }
+        m_window->resize(size);
+        frame();
+        end();
+    }
+
+    void report(QTextStream &out) const
+    {
+        auto ms = [](qint64 ns) { return QString::number(ns / 1e6, 'f', 3); };
+
+        out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+            .arg("phase", -8).arg("frames", 7).arg("p50 ms", 9).arg("p90 ms", 9)
+            .arg("p99 ms", 9).arg("max ms", 9).arg("created", 9).arg("released", 9);
+
+        QVector<qint64> all;
+        for (const Phase &phase : m_phases) {
+            all += phase.polishNsecs;
+            out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+                .arg(phase.name, -8).arg(phase.polishNsecs.size(), 7)
+                .arg(ms(percentile(phase.polishNsecs, 0.5)), 9)
+                .arg(ms(percentile(phase.polishNsecs, 0.9)), 9)
+                .arg(ms(percentile(phase.polishNsecs, 0.99)), 9)
+                .arg(ms(percentile(phase.polishNsecs, 1)), 9)
+                .arg(phase.end.delegatesCreated - phase.start.delegatesCreated, 9)
+                .arg(phase.end.delegatesReleased - phase.start.delegatesReleased, 9);
+        }
+
+        qint64 polishNsecs = std::accumulate(all.begin(), all.end(), qint64(0));
+        const auto &total = m_view->stats()->totals();
+        out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+            .arg("all", -8).arg(all.size(), 7)
+            .arg(ms(percentile(all, 0.5)), 9).arg(ms(percentile(all, 0.9)), 9)
+            .arg(ms(percentile(all, 0.99)), 9).arg(ms(percentile(all, 1)), 9)
+            .arg(total.delegatesCreated, 9).arg(total.delegatesReleased, 9);
+
+        out << "\n";
+        out << "wall time:            " << ms(m_wallNsecs) << " ms\n";
+        out << "polish time:          " << ms(polishNsecs) << " ms\n";
+        out << "delegates/s (wall):   " << QString::number(total.delegatesCreated / (m_wallNsecs / 1e9), 'f', 0) << "\n";
+        out << "delegates/s (polish): " << QString::number(total.delegatesCreated / (polishNsecs / 1e9), 'f', 0) << "\n";
+        out << "sections laid out:    " << total.sectionsLaidOut << " (" << ms(total.sectionLayoutNsecs) << " ms)\n";
+        out << "grid layouts:         " << total.gridLayouts << "\n";
+        out << "viewport-only frames: " << total.viewportLayouts << "\n";
+        out << "sections compacted:   " << total.sectionsCompacted << "\n";
+        out << "model data() calls:   " << total.dataCalls << "\n";
+        out << "live delegates:       " << m_view->stats()->liveDelegates() << "\n";
+        out << "view memory estimate: " << m_view->memoryUsage().value("total").toLongLong() / 1024 << " KiB\n";
+        out << "peak memory:          " << peakMemoryKb() << " KiB\n";
+    }
+
+private:
+    QQuickView *m_window;
+    FlexView *m_view;
+    bool m_render;
+    QElapsedTimer m_timer;
+    qint64 m_wallNsecs = 0;
+    QVector<Phase> m_phases;
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    if (!qEnvironmentVariableIsSet("QT_QUICK_BACKEND"))
+        QQuickWindow::setSceneGraphBackend(QSGRendererInterface::Software);
+
+    QGuiApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("End-to-end FlexView scrolling benchmark");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"rows", "Number of model rows (1000 to 10000000)", "count", "100000"},
+        {"section-length", "Mean items per section, 0 for no sections", "count", "500"},
+        {"section-jitter", "Fraction by which section lengths vary", "fraction", "0.5"},
+        {"ratios", "Ratio distribution: square, camera, mixed, panorama", "name", "mixed"},
+        {"seed", "Seed for generated rows", "seed", "1"},
+        {"width", "Window width", "px", "1280"},
+        {"height", "Window height", "px", "800"},
+        {"ideal-height", "FlexView idealHeight", "px", "200"},
+        {"layout", "FlexView layoutMode: justified, or grid of square cells", "mode", "justified"},
+        {"cache-buffer", "FlexView cacheBuffer", "px", "400"},
+        {"retain-buffer", "FlexView retainBuffer, negative to never compact", "px", "10000"},
+        {"frames", "Frames of steady scrolling", "count", "600"},
+        {"render", "Also render every frame with grabWindow()"},
+        {"trace", "Write trace events to file", "file"},
+    });
+    parser.process(app);
+
+    SyntheticModel::Options options;
+    options.count = std::clamp(parser.value("rows").toInt(), 1000, 10000000);
+    options.sectionLength = parser.value("section-length").toInt();
+    options.sectionJitter = parser.value("section-jitter").toDouble();
+    options.seed = parser.value("seed").toUInt();
+    if (!SyntheticModel::parseRatios(parser.value("ratios"), &options.ratios)) {
+        qCritical() << "Unknown ratio distribution" << parser.value("ratios");
+        return 1;
+    }
+
+    if (parser.isSet("trace"))
+        FlexTrace::start(parser.value("trace"));
+
+    QuickViewsPlugin().registerTypes("Crimson.Views");
+
+    SyntheticModel model(options);
+    QQuickView window;
+    window.setResizeMode(QQuickView::SizeRootObjectToView);
+    window.rootContext()->setContextProperty("benchModel", &model);
+    window.rootContext()->setContextProperty("benchSectionRole", QString(options.sectionLength > 0 ? "section" : ""));
+    window.rootContext()->setContextProperty("benchIdealHeight", parser.value("ideal-height").toDouble());
+    window.rootContext()->setContextProperty("benchCacheBuffer", parser.value("cache-buffer").toDouble());
+    window.setSource(QUrl("qrc:/benchview.qml"));
+
+    FlexView *view = qobject_cast<FlexView*>(window.rootObject());
+    if (!view) {
+        qCritical() << "Failed to load FlexView:" << window.errors();
+        return 1;
+    }
+    view->setRetainBuffer(parser.value("retain-buffer").toDouble());
+    if (parser.value("layout") == "grid") {
+        view->setLayoutMode(FlexView::GridLayout);
+    } else if (parser.value("layout") != "justified") {
+        qCritical() << "Unknown layout mode" << parser.value("layout");
+        return 1;
+    }
+    window.resize(parser.value("width").toInt(), parser.value("height").toInt());
+    window.show();
+
+    QTextStream out(stdout);
+    out << "flexbench: " << options.count << " rows in " << model.sectionCount() << " sections, ratios "
+        << parser.value("ratios") << ", " << window.width() << "x" << window.height() << "\n\n";
+
+    Bench bench(&window, view, parser.isSet("render"));
+
+    bench.begin("initial");
+    bench.frame();
+    bench.end();
+
+    bench.steady(parser.value("frames").toInt(), 8);
+    bench.flicks(6, 6000, 1500);
+    bench.jumps(4, 3);
+    bench.seeks(20, 3);
+    bench.keys(200, 20);
+    bench.resizes(10);
+
+    bench.report(out);
+    FlexTrace::stop();
+    return 0;
+}
@@ -1,9 +1,12 @@
 #include "delegatemanager.h"
+#include "flexstats.h"
+#include "flextrace.h"
 #include <QQmlContext>
 #include <QQmlComponent>
 #include <QAbstractItemModel>
 #include <QtQml/private/qqmlglobal_p.h>
 #include <QtCore/private/qmetaobjectbuilder_p.h>
+#include <algorithm>
 
 Q_LOGGING_CATEGORY(lcDelegate, "crimson.flexview.delegate")
 
@@ -17,6 +20,8 @@ public:
     {
     };
 
+    int index() const { return m_index; }
+
     void setIndex(int index)
     {
         if (index == m_index)
@@ -75,6 +80,8 @@ public:
                 }
 
                 QAbstractItemModel *model = m_mgr->m_model;
+                if (m_mgr->m_stats)
+                    m_mgr->m_stats->current.dataCalls++;
                 *reinterpret_cast<QVariant*>(argv[0]) = model->data(model->index(m_index, 0), role);
             } else if (id == 0) {
                 *reinterpret_cast<int*>(argv[0]) = m_index;
@@ -135,9 +142,17 @@ bool DelegateManager::createMetaObject()
     return true;
 }
 
+DelegateManager::ItemList::iterator DelegateManager::lowerBound(int index)
+{
+    return std::lower_bound(m_items.begin(), m_items.end(), index, [](const ItemEntry &e, int i) { return e.index < i; });
+}
+
 DelegateRef DelegateManager::item(int index) const
 {
-    return m_items.value(index).lock();
+    auto it = std::lower_bound(m_items.begin(), m_items.end(), index, [](const ItemEntry &e, int i) { return e.index < i; });
+    if (it == m_items.end() || it->index != index)
+        return nullptr;
+    return it->item.lock();
 }
 
 DelegateRef DelegateManager::createItem(int index, QQmlComponent *component, QQuickItem *parent, QQmlIncubator::IncubationMode mode)
@@ -145,13 +160,18 @@ DelegateRef DelegateManager::createItem(int index, QQmlComponent *component, QQu
     if (m_recentlyReleased > 100)
         cleanup();
 
-    auto it = m_items.lowerBound(index);
-    if (it != m_items.end() && it.key() == index) {
-        if (auto ref = it->lock())
+    auto it = lowerBound(index);
+    if (it != m_items.end() && it->index == index) {
+        if (auto ref = it->item.lock()) {
+            if (m_stats)
+                m_stats->current.delegatesReused++;
             return ref;
+        }
     }
 
     // XXX Incubation
+    FlexTraceScope trace("DelegateManager::createItem");
+    trace.arg("index", index);
 
     if (!createMetaObject()) {
         qCWarning(lcDelegate) << "Cannot create meta object for model";
@@ -162,6 +182,8 @@ DelegateRef DelegateManager::createItem(int index, QQmlComponent *component, QQu
     DelegateContextObject *ctxObject = new DelegateContextObject(this, m_dataMetaObject, index);
     context->setContextObject(ctxObject);
     context->setContextProperty("model", ctxObject);
+    for (auto it = m_contextProperties.constBegin(); it != m_contextProperties.constEnd(); it++)
+        context->setContextProperty(it.key(), it.value());
 
     QObject *object = component->beginCreate(context);
     QQuickItem *item = qobject_cast<QQuickItem*>(object);
@@ -181,9 +203,18 @@ DelegateRef DelegateManager::createItem(int index, QQmlComponent *component, QQu
 
     qCDebug(lcDelegate) << "created delegate" << item << "for index" << index;
     component->completeCreate();
+    if (m_stats) {
+        m_stats->current.delegatesCreated++;
+        m_stats->liveDelegateCount++;
+        FLEX_TRACE_COUNTER("liveDelegates", m_stats->liveDelegateCount);
+    }
 
     auto ref = std::shared_ptr<QQuickItem>(item, [this](auto item) { release(item); });
-    m_items.insert(it, index, ref);
+    it = lowerBound(index);
+    if (it != m_items.end() && it->index == index)
+        it->item = ref;
+    else
+        m_items.insert(it, ItemEntry{index, ref});
     return ref;
 }
 
@@ -194,6 +225,11 @@ void DelegateManager::release(QQuickItem *item)
     // this path). It's also a bit annoying to track back to an index from here.
     // It will be cleaned up eventually.
     m_recentlyReleased++;
+    if (m_stats) {
+        m_stats->current.delegatesReleased++;
+        m_stats->liveDelegateCount--;
+        FLEX_TRACE_COUNTER("liveDelegates", m_stats->liveDelegateCount);
+    }
 
     // XXX delay the actual deletion slightly to prevent any delegate bouncing
     item->setVisible(false);
@@ -202,48 +238,64 @@ void DelegateManager::release(QQuickItem *item)
 
 void DelegateManager::cleanup()
 {
-    int removed = 0;
-    auto it = m_items.begin();
-    while (it != m_items.end()) {
-        if (it->expired()) {
-            it = m_items.erase(it);
-            removed++;
-        } else {
-            it++;
-        }
-    }
+    auto end = std::remove_if(m_items.begin(), m_items.end(), [](const ItemEntry &e) { return e.item.expired(); });
+    int removed = std::distance(end, m_items.end());
+    m_items.erase(end, m_items.end());
     m_recentlyReleased = 0;
 
     if (removed)
         qCDebug(lcDelegate) << "cleaned up" << removed << "released delegates from map";
 }
 
+void DelegateManager::trim()
+{
+    cleanup();
+    m_items.shrink_to_fit();
+}
+
+// Entries stay sorted when shifted, so they are adjusted in place
 void DelegateManager::adjustIndex(int from, int delta)
 {
-    auto it = m_items.constEnd();
-    if (m_items.isEmpty() || (it-1).key() < from)
-        return;
-
-    // QMap claims that inserting the largest item first is more efficient
-    QMap<int, std::weak_ptr<QQuickItem>> adjusted;
-    do {
-        it--;
-        int key = it.key();
-        if (key < from) {
-            adjusted.insert(adjusted.constBegin(), key, it.value());
-            continue;
-        } else if (delta < 0 && from - key < delta)
-            continue;
-        key += delta;
+    auto it = lowerBound(from);
+    if (delta < 0)
+        it = m_items.erase(it, lowerBound(from - delta));
+
+    for (; it != m_items.end(); it++) {
+        it->index += delta;
+        if (auto item = it->item.lock())
+            contextObject(item.get())->setIndex(it->index);
+    }
+}
 
-        auto item = it.value().lock();
-        if (!item)
+// Re-add a live delegate under a new index, for rows that were moved. adjustIndex has
+// already dropped the old index when the rows were removed.
+void DelegateManager::restoreItem(int index, const DelegateRef &item)
+{
+    Q_ASSERT(item);
+    auto it = lowerBound(index);
+    if (it != m_items.end() && it->index == index)
+        it->item = item;
+    else
+        m_items.insert(it, ItemEntry{index, item});
+    contextObject(item.get())->setIndex(index);
+}
+
+// Move delegates to newIndex[index] after a layout change. A new index of -1 drops the
+// delegate from the map, and indices past the end of newIndex are unchanged.
+void DelegateManager::remap(const QVector<int> &newIndex)
+{
+    ItemList remapped;
+    remapped.reserve(m_items.size());
+    for (const ItemEntry &entry : m_items) {
+        int key = entry.index < newIndex.size() ? newIndex[entry.index] : entry.index;
+        auto item = entry.item.lock();
+        if (key < 0 || !item)
             continue;
         contextObject(item.get())->setIndex(key);
-        adjusted.insert(adjusted.constBegin(), key, item);
-    } while (it != m_items.constBegin());
-
-    m_items = adjusted;
+        remapped.push_back(ItemEntry{key, item});
+    }
+    std::sort(remapped.begin(), remapped.end(), [](const ItemEntry &a, const ItemEntry &b) { return a.index < b.index; });
+    m_items.swap(remapped);
 }
 
 DelegateContextObject *DelegateManager::contextObject(QQuickItem *item)
@@ -258,12 +310,43 @@ DelegateContextObject *DelegateManager::contextObject(QQuickItem *item)
     return nullptr;
 }
 
-void DelegateManager::dataChanged(int row, const QVector<int> &roles)
+// Only live delegates are visited, so large changes cost the same as the delegates in them
+void DelegateManager::dataChanged(int first, int last, const QVector<int> &roles)
+{
+    for (auto it = lowerBound(first); it != m_items.end() && it->index <= last; it++) {
+        if (auto item = it->item.lock())
+            contextObject(item.get())->dataChanged(roles);
+    }
+}
+
+int DelegateManager::delegateIndex(QObject *object)
+{
+    for (QQmlContext *ctx = qmlContext(object); ctx; ctx = ctx->parentContext()) {
+        QObject *ctxObject = ctx->contextObject();
+        if (ctxObject && ctxObject->qt_metacast("DelegateContextObject"))
+            return static_cast<DelegateContextObject*>(ctxObject)->index();
+    }
+    return -1;
+}
+
+bool DelegateManager::validate()
 {
-    auto ref = item(row);
-    if (ref) {
-        contextObject(ref.get())->dataChanged(roles);
+    bool valid = true;
+    for (auto it = m_items.begin(); it != m_items.end(); it++) {
+        if (it != m_items.begin() && std::prev(it)->index >= it->index) {
+            qCWarning(lcDelegate) << "delegate for index" << it->index << "is out of order";
+            valid = false;
+        }
+        auto item = it->item.lock();
+        if (!item)
+            continue;
+        int index = contextObject(item.get())->index();
+        if (index != it->index) {
+            qCWarning(lcDelegate) << "delegate for index" << it->index << "has index" << index;
+            valid = false;
+        }
     }
+    return valid;
 }
 
 void DelegateManager::clear()
@@ -7,8 +7,10 @@
 #include <QSharedPointer>
 #include <QLoggingCategory>
 #include <memory>
+#include <vector>
 
 class QAbstractItemModel;
+class FlexViewStats;
 
 typedef std::shared_ptr<QQuickItem> DelegateRef;
 class DelegateContextObject;
@@ -24,6 +26,9 @@ public:
     virtual ~DelegateManager();
 
     void setModel(QAbstractItemModel *model);
+    void setStats(FlexViewStats *stats) { m_stats = stats; }
+    // Set on the context of each delegate created after this
+    void setContextProperty(const QString &name, const QVariant &value) { m_contextProperties.insert(name, value); }
 
     DelegateRef item(int index) const;
     DelegateRef createItem(int index, QQmlComponent *component, QQuickItem *parent, QQmlIncubator::IncubationMode mode);
@@ -32,12 +37,35 @@ public:
     void clear();
 
     void adjustIndex(int from, int delta);
-    void dataChanged(int row, const QVector<int> &roles);
+    void restoreItem(int index, const DelegateRef &item);
+    void remap(const QVector<int> &newIndex);
+    void dataChanged(int first, int last, const QVector<int> &roles);
+    bool validate();
+
+    // The index of the delegate that object was created in, from its QML context, or -1
+    static int delegateIndex(QObject *object);
+
+    // Entries in the index map, including released delegates that haven't been cleaned up
+    int entryCount() const { return int(m_items.size()); }
+    qint64 entryBytes() const { return qint64(m_items.capacity()) * sizeof(ItemEntry); }
+    static qint64 entrySize() { return sizeof(ItemEntry); }
+    // Drop entries of released delegates and free unused capacity
+    void trim();
 
 private:
-    QMap<int, std::weak_ptr<QQuickItem>> m_items;
+    // Delegates sorted by index; only live delegates (and recently released ones, until
+    // cleanup) are stored, so shifting them in place is cheap
+    struct ItemEntry
+    {
+        int index;
+        std::weak_ptr<QQuickItem> item;
+    };
+    typedef std::vector<ItemEntry> ItemList;
+    ItemList m_items;
     QAbstractItemModel *m_model = nullptr;
+    FlexViewStats *m_stats = nullptr;
     QHash<int, int> m_rolePropertyMap;
+    QHash<QString, QVariant> m_contextProperties;
     QSharedPointer<QMetaObject> m_dataMetaObject = nullptr;
     int m_recentlyReleased = 0;
 
@@ -46,6 +74,7 @@ private:
     void cleanup();
 
     DelegateContextObject *contextObject(QQuickItem *item);
+    ItemList::iterator lowerBound(int index);
 };
 
 Q_DECLARE_LOGGING_CATEGORY(lcDelegate)
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <QtGlobal>
+#include <vector>
+
+// FenwickTree (binary indexed tree) keeps prefix sums over a sequence of values. Changing
+// a value, appending or removing the last value, and finding the prefix sum or the
+// position of a sum are all O(log n). Inserting or removing at position i rebuilds only
+// the nodes after it, in O(n - i). Building it from a sequence is O(n).
+template<typename T>
+class FenwickTree
+{
+public:
+    int size() const { return int(m_tree.size()); }
+    bool isEmpty() const { return m_tree.empty(); }
+
+    void clear()
+    {
+        m_values.clear();
+        m_tree.clear();
+    }
+
+    void assign(const std::vector<T> &values)
+    {
+        m_values = values;
+        m_tree = values;
+        int n = size();
+        for (int i = 1; i <= n; i++) {
+            int parent = i + (i & -i);
+            if (parent <= n)
+                m_tree[parent - 1] += m_tree[i - 1];
+        }
+    }
+
+    void append(T value) { insert(size(), value); }
+    void removeLast() { remove(size() - 1); }
+
+    void insert(int i, T value)
+    {
+        Q_ASSERT(i >= 0 && i <= size());
+        m_values.insert(m_values.begin() + i, value);
+        m_tree.push_back(T());
+        rebuildFrom(i);
+    }
+
+    void remove(int i)
+    {
+        Q_ASSERT(i >= 0 && i < size());
+        m_values.erase(m_values.begin() + i);
+        m_tree.pop_back();
+        rebuildFrom(i);
+    }
+
+    T value(int i) const { return m_values[i]; }
+
+    void add(int i, T delta)
+    {
+        Q_ASSERT(i >= 0 && i < size());
+        m_values[i] += delta;
+        for (i++; i <= size(); i += i & -i)
+            m_tree[i - 1] += delta;
+    }
+
+    // Sum of the first n values
+    T prefix(int n) const
+    {
+        Q_ASSERT(n >= 0 && n <= size());
+        T sum = T();
+        for (; n > 0; n -= n & -n)
+            sum += m_tree[n - 1];
+        return sum;
+    }
+
+    T total() const { return prefix(size()); }
+
+    // The first position i where prefix(i + 1) > target, or size() if there is none.
+    // All values must be non-negative.
+    int upperBound(T target) const
+    {
+        int pos = 0;
+        int step = 1;
+        while (step * 2 <= size())
+            step *= 2;
+        for (; step > 0; step /= 2) {
+            if (pos + step <= size() && m_tree[pos + step - 1] <= target) {
+                pos += step;
+                target -= m_tree[pos - 1];
+            }
+        }
+        return pos;
+    }
+
+private:
+    // Values are kept as well, so the nodes after a position can be built again
+    std::vector<T> m_values;
+    std::vector<T> m_tree;
+
+    // Node n covers values (n - lowbit(n), n], which is its own value plus the nodes
+    // n - 1, n - 2, n - 4, ... below lowbit(n). Nodes up to position i don't cover it, and
+    // the nodes after it are built in order, so their children are always up to date.
+    void rebuildFrom(int i)
+    {
+        for (int n = i + 1; n <= size(); n++) {
+            T sum = m_values[n - 1];
+            for (int child = n - 1, low = n - (n & -n); child > low; child -= child & -child)
+                sum += m_tree[child - 1];
+            m_tree[n - 1] = sum;
+        }
+    }
+};
@@ -0,0 +1,549 @@
+#include "flexlayoutengine.h"
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+Q_LOGGING_CATEGORY(lcFlexLayout, "crimson.flexview.layout.flex", QtWarningMsg)
+
+#if 0
+#define DEBUG_LAYOUT() qCDebug(lcFlexLayout)
+#define DEBUGGING_LAYOUT
+#else
+#define DEBUG_LAYOUT() if (false) qCDebug(lcFlexLayout)
+#endif
+
+qreal FlexLayoutEngine::badness(qreal height) const
+{
+    if (height < m_params.idealHeight) {
+        return 1 - (height - m_params.minHeight) / (m_params.idealHeight - m_params.minHeight);
+    } else if (height > m_params.idealHeight) {
+        return 1 - (m_params.maxHeight - height) / (m_params.maxHeight - m_params.idealHeight);
+    } else {
+        return 0;
+    }
+}
+
+int FlexLayoutEngine::rowAt(qreal y) const
+{
+    if (!rowCount())
+        return -1;
+    int r = std::max(rowsStartingBefore(y, true), 1) - 1;
+    const FlexRow row = this->row(r);
+    if (y >= row.y + row.height)
+        return -1;
+    return r;
+}
+
+int FlexLayoutEngine::indexAtX(const FlexRow &row, qreal target, bool nearest) const
+{
+    qreal x = 0;
+    qreal dist = -1;
+    for (int i = row.start; i <= row.end; i++) {
+        if (i > row.start)
+            x += m_params.hSpacing;
+
+        qreal width = itemWidth(i, row);
+
+        if (target >= x && target < x + width) {
+            return i;
+        } else if (target < x) {
+            if (nearest)
+                return (dist < 0 || x - target < dist) ? i : i - 1;
+            else
+                break;
+        } else {
+            dist = target - (x + width);
+            x += width;
+        }
+    }
+    return nearest ? row.end : -1;
+}
+
+QRectF FlexLayoutEngine::geometryOf(int index) const
+{
+    int rowIndex = rowForIndex(index);
+    if (rowIndex < 0)
+        return QRectF();
+    const FlexRow row = this->row(rowIndex);
+
+    QRectF geom;
+    geom.setY(row.y);
+    geom.setHeight(row.height);
+
+    for (int i = row.start; i <= index; i++) {
+        if (i > row.start)
+            geom.setX(geom.x() + m_params.hSpacing);
+
+        qreal width = itemWidth(i, row);
+        if (i == index) {
+            geom.setWidth(width);
+            break;
+        }
+        geom.setX(geom.x() + width);
+    }
+
+    return geom;
+}
+
+FlexJustifiedLayout::FlexJustifiedLayout(const GapBuffer<qreal> &sizes)
+    : m_sizes(sizes)
+{
+}
+
+FlexLayoutEngine::Cost FlexJustifiedLayout::layout(const FlexLayoutParams &params, int count)
+{
+    Q_ASSERT(m_sizes.size() == count);
+    // Chunks are only kept if the changes since the last layout were all reported
+    bool full = params != m_params || count != m_count;
+    m_params = params;
+    m_count = count;
+    m_contentHeight = 0;
+    Cost result;
+
+    QVector<Chunk> chunks;
+    int old = 0;
+    int rows = 0;
+    for (int start = 0; start < count; ) {
+        while (old < m_chunks.size() && m_chunks[old].start < start)
+            old++;
+        Chunk chunk;
+        if (!full && old < m_chunks.size() && m_chunks[old].start == start && !m_chunks[old].dirty)
+            chunk = std::move(m_chunks[old]);
+        else
+            chunk = layoutChunk(start, result);
+
+        if (!chunks.isEmpty())
+            m_contentHeight += params.vSpacing;
+        chunk.firstRow = rows;
+        chunk.y = m_contentHeight;
+        rows += chunk.rowCount;
+        m_contentHeight = bottomOf(chunk);
+        start += chunk.count;
+        chunks.append(std::move(chunk));
+    }
+    m_chunks.swap(chunks);
+
+    DEBUG_LAYOUT() << "layout for" << count << "items in" << m_chunks.size() << "chunks built" << result.rowsBuilt << "rows";
+    return result;
+}
+
+FlexJustifiedLayout::Chunk FlexJustifiedLayout::layoutChunk(int start, Cost &cost) const
+{
+    Chunk chunk;
+    chunk.start = start;
+    int end = std::min(start + chunkSize, m_count);
+    Cost rangeCost = layoutRange(start, end, chunk.rows);
+    cost.rowsBuilt += rangeCost.rowsBuilt;
+    cost.additions += rangeCost.additions;
+
+    // Items of the last row start the next chunk, unless there's only one row
+    if (end < m_count && chunk.rows.size() > 1)
+        chunk.rows.removeLast();
+    const FlexRow &last = chunk.rows.last();
+    chunk.count = last.end + 1;
+    chunk.rowCount = chunk.rows.size();
+    chunk.lastRowY = last.y;
+    chunk.lastRowHeight = last.height;
+    return chunk;
+}
+
+// Rows for items from first up to end, as if they were the whole section. Rows start from
+// 0 and y = 0.
+FlexLayoutEngine::Cost FlexJustifiedLayout::layoutRange(int first, int end, QVector<FlexRow> &out) const
+{
+    const int count = end - first;
+    out.clear();
+    Cost result;
+    if (count < 1)
+        return result;
+
+    const qreal viewportWidth = m_params.viewportWidth;
+    const qreal hSpacing = m_params.hSpacing;
+    const qreal minHeight = m_params.minHeight;
+    const qreal idealHeight = m_params.idealHeight;
+    const qreal maxHeight = m_params.maxHeight;
+
+    std::vector<FlexRow> rows;
+    std::vector<FlexRow> openRows{FlexRow(0)};
+
+    DEBUG_LAYOUT() << "layout for" << count << "items from" << first;
+
+    for (int i = 0; i < count; i++) {
+        qreal size = m_sizes[first + i];
+
+        FlexRow addingRow(0);
+        Q_ASSERT(!openRows.empty());
+        for (auto it = openRows.begin(); it != openRows.end(); ) {
+            FlexRow &candidate = *it;
+            candidate.ratio += size;
+            candidate.height = (viewportWidth - (hSpacing * (i - candidate.start))) / candidate.ratio;
+            result.additions++;
+
+            if (candidate.height > maxHeight && i+1 < count) {
+                it++;
+                continue;
+            } else if (candidate.height < minHeight && candidate.end >= 0) {
+                // Below minimum height, and at least one candidate has been recorded with this start index
+                DEBUG_LAYOUT() << ".... no more rows start at" << candidate.start << "because adding"
+                    << i << "reduces height to" << candidate.height << "with minimum" << minHeight;
+                it = openRows.erase(it);
+                continue;
+            } else {
+                qreal cost = candidate.cost + badness(candidate.height);
+                candidate.end = i;
+
+                if (addingRow.end < 0 || cost < addingRow.cost) {
+                    addingRow = candidate;
+                    addingRow.cost = cost;
+
+                    if (addingRow.height > maxHeight) {
+                        // Set last partial row to idealHeight, but keep original badness
+                        addingRow.height = idealHeight;
+                    } else if (addingRow.height < minHeight) {
+                        // XXX if i > row.start, the candidate ending at i-1 was just as viable.
+                        // There was no way to know that at the time, and adding it now is complex.
+                        // XXX revisit how complex that actually is... can candidate be changed back?
+                        it = openRows.erase(it);
+                        continue;
+                    }
+                }
+
+                it++;
+                continue;
+            }
+
+            Q_UNREACHABLE();
+        }
+
+        if (addingRow.end >= 0) {
+            DEBUG_LAYOUT() << ".. row:" << addingRow.start << "to" << addingRow.end << "height" << addingRow.height
+                << "ratio" << addingRow.ratio << "badness" << badness(addingRow.height) << "cost" << addingRow.cost;
+            rows.push_back(addingRow);
+
+            if (addingRow.height < minHeight) {
+                DEBUG_LAYOUT() << ".... row of height" << addingRow.height << "is below minimum" << minHeight << "but no other rows could start from" << addingRow.start;
+            }
+
+            FlexRow next(i+1);
+            next.cost = addingRow.cost;
+            next.prev = rows.size() - 1;
+            openRows.push_back(next);
+        }
+    }
+
+    for (int i = rows.size() - 1; i >= 0; i = rows[i].prev)
+        out.append(rows[i]);
+    std::reverse(out.begin(), out.end());
+    Q_ASSERT(!out.isEmpty());
+    Q_ASSERT(out[0].start == 0);
+    qreal y = 0;
+    for (int i = 0; i < out.size(); i++) {
+        if (i > 0)
+            y += m_params.vSpacing;
+        out[i].y = y;
+        y += out[i].height;
+    }
+
+#ifdef DEBUGGING_LAYOUT
+    if (lcFlexLayout().isDebugEnabled()) {
+        qCDebug(lcFlexLayout) << ".. selected rows:";
+        for (const auto &row : out) {
+            qCDebug(lcFlexLayout) << "...." << first + row.start << "to" << first + row.end << "cost" << row.cost << "height" << row.height;
+        }
+    }
+#endif
+
+    result.rowsBuilt = rows.size();
+    return result;
+}
+
+// Builds the rows of a released chunk again. Its items haven't changed since it was laid
+// out, or it would be dirty, so they're the same rows.
+const QVector<FlexRow> &FlexJustifiedLayout::rowsOf(const Chunk &chunk) const
+{
+    if (chunk.rows.isEmpty() && chunk.rowCount > 0) {
+        Q_ASSERT(!chunk.dirty);
+        layoutRange(chunk.start, std::min(chunk.start + chunkSize, m_count), chunk.rows);
+        // Only a dirty chunk could differ, and it's replaced by the next layout
+        chunk.rows.resize(chunk.rowCount);
+        Q_ASSERT(chunk.rows.last().end + 1 == chunk.count);
+    }
+    return chunk.rows;
+}
+
+// A chunk is laid out from the chunkSize items at its start, including some of the next
+// chunk's, and keeps its last row only if item start + chunkSize doesn't exist. So it's
+// dirty if any item from start up to start + chunkSize changes.
+void FlexJustifiedLayout::markDirty(int first, int last)
+{
+    auto it = std::lower_bound(m_chunks.begin(), m_chunks.end(), first - chunkSize,
+        [](const Chunk &chunk, int i) { return chunk.start < i; });
+    for (; it != m_chunks.end() && it->start <= last; it++)
+        it->dirty = true;
+}
+
+void FlexJustifiedLayout::insertItems(int index, int count)
+{
+    markDirty(index, index);
+    for (Chunk &chunk : m_chunks) {
+        if (chunk.start > index)
+            chunk.start += count;
+    }
+    m_count += count;
+}
+
+void FlexJustifiedLayout::removeItems(int index, int count)
+{
+    markDirty(index, index + count - 1);
+    for (Chunk &chunk : m_chunks) {
+        if (chunk.start >= index + count)
+            chunk.start -= count;
+        else if (chunk.start > index)
+            chunk.start = index;
+    }
+    m_count -= count;
+}
+
+void FlexJustifiedLayout::changeItems(int index, int count)
+{
+    markDirty(index, index + count - 1);
+}
+
+void FlexJustifiedLayout::releaseRowsOutside(int firstRow, int endRow, int index)
+{
+    if (m_chunks.size() < 2)
+        return;
+    for (const Chunk &chunk : qAsConst(m_chunks)) {
+        if (chunk.rows.isEmpty() || chunk.dirty)
+            continue;
+        if (chunk.firstRow < endRow && chunk.firstRow + chunk.rowCount > firstRow)
+            continue;
+        if (index >= chunk.start && index < chunk.start + chunk.count)
+            continue;
+        chunk.rows = QVector<FlexRow>();
+    }
+}
+
+int FlexJustifiedLayout::chunkAtRow(int r) const
+{
+    auto it = std::upper_bound(m_chunks.constBegin(), m_chunks.constEnd(), r,
+        [](int r, const Chunk &chunk) { return r < chunk.firstRow; });
+    return std::distance(m_chunks.constBegin(), it) - 1;
+}
+
+int FlexJustifiedLayout::chunkAtIndex(int index) const
+{
+    auto it = std::upper_bound(m_chunks.constBegin(), m_chunks.constEnd(), index,
+        [](int index, const Chunk &chunk) { return index < chunk.start; });
+    return std::distance(m_chunks.constBegin(), it) - 1;
+}
+
+int FlexJustifiedLayout::rowCount() const
+{
+    if (m_chunks.isEmpty())
+        return 0;
+    return m_chunks.last().firstRow + m_chunks.last().rowCount;
+}
+
+FlexRow FlexJustifiedLayout::row(int r) const
+{
+    int c = chunkAtRow(r);
+    Q_ASSERT(c >= 0 && r < rowCount());
+    const Chunk &chunk = m_chunks[c];
+    FlexRow row = rowsOf(chunk)[r - chunk.firstRow];
+    row.start += chunk.start;
+    row.end += chunk.start;
+    row.y += chunk.y;
+    return row;
+}
+
+int FlexJustifiedLayout::rowForIndex(int index) const
+{
+    int c = chunkAtIndex(index);
+    if (c < 0 || index >= m_chunks[c].start + m_chunks[c].count)
+        return -1;
+    const Chunk &chunk = m_chunks[c];
+    const QVector<FlexRow> &rows = rowsOf(chunk);
+    auto it = std::lower_bound(rows.begin(), rows.end(), index - chunk.start, [](const FlexRow &row, int i) { return row.end < i; });
+    Q_ASSERT(it != rows.end());
+    return chunk.firstRow + std::distance(rows.begin(), it);
+}
+
+// Rows are compared by their position in the section, as row() returns them, so results
+// don't depend on rounding of the chunk's offset
+int FlexJustifiedLayout::firstRowEndingAfter(qreal y, bool inclusive) const
+{
+    auto chunkIt = inclusive
+        ? std::lower_bound(m_chunks.constBegin(), m_chunks.constEnd(), y,
+            [](const Chunk &chunk, qreal y) { return bottomOf(chunk) < y; })
+        : std::upper_bound(m_chunks.constBegin(), m_chunks.constEnd(), y,
+            [](qreal y, const Chunk &chunk) { return y < bottomOf(chunk); });
+    if (chunkIt == m_chunks.constEnd())
+        return rowCount();
+
+    const Chunk &chunk = *chunkIt;
+    const QVector<FlexRow> &rows = rowsOf(chunk);
+    const qreal top = chunk.y;
+    auto it = inclusive
+        ? std::lower_bound(rows.constBegin(), rows.constEnd(), y,
+            [top](const FlexRow &row, qreal y) { return top + row.y + row.height < y; })
+        : std::upper_bound(rows.constBegin(), rows.constEnd(), y,
+            [top](qreal y, const FlexRow &row) { return y < top + row.y + row.height; });
+    return chunk.firstRow + std::distance(rows.constBegin(), it);
+}
+
+int FlexJustifiedLayout::rowsStartingBefore(qreal y, bool inclusive) const
+{
+    auto chunkIt = inclusive
+        ? std::upper_bound(m_chunks.constBegin(), m_chunks.constEnd(), y,
+            [](qreal y, const Chunk &chunk) { return y < chunk.y; })
+        : std::lower_bound(m_chunks.constBegin(), m_chunks.constEnd(), y,
+            [](const Chunk &chunk, qreal y) { return chunk.y < y; });
+    if (chunkIt == m_chunks.constBegin())
+        return 0;
+
+    const Chunk &chunk = *(chunkIt - 1);
+    const QVector<FlexRow> &rows = rowsOf(chunk);
+    const qreal top = chunk.y;
+    auto it = inclusive
+        ? std::upper_bound(rows.constBegin(), rows.constEnd(), y,
+            [top](qreal y, const FlexRow &row) { return y < top + row.y; })
+        : std::lower_bound(rows.constBegin(), rows.constEnd(), y,
+            [top](const FlexRow &row, qreal y) { return top + row.y < y; });
+    return chunk.firstRow + std::distance(rows.constBegin(), it);
+}
+
+qint64 FlexJustifiedLayout::bytes() const
+{
+    qint64 bytes = qint64(m_chunks.capacity()) * sizeof(Chunk);
+    for (const Chunk &chunk : m_chunks)
+        bytes += qint64(chunk.rows.capacity()) * sizeof(FlexRow);
+    return bytes;
+}
+
+void FlexJustifiedLayout::squeeze()
+{
+    m_chunks.squeeze();
+    for (const Chunk &chunk : qAsConst(m_chunks))
+        chunk.rows.squeeze();
+}
+
+// Every row has as many cells as fit at about idealHeight, and the last row keeps their
+// size instead of stretching. Rows aren't stored, so a layout is O(1) however many items
+// there are.
+FlexLayoutEngine::Cost FlexGridLayout::layout(const FlexLayoutParams &params, int count)
+{
+    Q_ASSERT(m_ratio > 0);
+    m_params = params;
+    m_count = count;
+    m_contentHeight = 0;
+
+    auto heightFor = [&](int columns) {
+        return (params.viewportWidth - params.hSpacing * (columns - 1)) / (columns * m_ratio);
+    };
+
+    // Columns at idealHeight, rounded to whichever side is less bad
+    m_columns = std::max(1, int((params.viewportWidth + params.hSpacing) / (m_ratio * params.idealHeight + params.hSpacing)));
+    if (heightFor(m_columns + 1) > 0 && badness(heightFor(m_columns + 1)) < badness(heightFor(m_columns)))
+        m_columns++;
+    m_rowHeight = heightFor(m_columns);
+    if (m_rowHeight <= 0) {
+        // Spacing alone is wider than the viewport
+        m_columns = 1;
+        m_rowHeight = params.viewportWidth / m_ratio;
+    }
+    m_itemWidth = m_rowHeight * m_ratio;
+
+    int rows = rowCount();
+    if (rows > 0)
+        m_contentHeight = rows * m_rowHeight + (rows - 1) * params.vSpacing;
+    return Cost();
+}
+
+int FlexGridLayout::rowCount() const
+{
+    if (!m_columns)
+        return 0;
+    return (m_count + m_columns - 1) / m_columns;
+}
+
+FlexRow FlexGridLayout::row(int r) const
+{
+    Q_ASSERT(r >= 0 && r < rowCount());
+    FlexRow row(r * m_columns);
+    row.end = std::min(row.start + m_columns, m_count) - 1;
+    row.ratio = (row.end - row.start + 1) * m_ratio;
+    row.height = m_rowHeight;
+    row.y = r * (m_rowHeight + m_params.vSpacing);
+    return row;
+}
+
+int FlexGridLayout::rowForIndex(int index) const
+{
+    if (index < 0 || index >= m_count || !m_columns)
+        return -1;
+    return index / m_columns;
+}
+
+// Rounding can be off by one at a row's edge, so estimates are checked against the rows
+int FlexGridLayout::firstRowEndingAfter(qreal y, bool inclusive) const
+{
+    qreal pitch = m_rowHeight + m_params.vSpacing;
+    auto endsAfter = [&](int r) {
+        qreal end = r * pitch + m_rowHeight;
+        return inclusive ? end >= y : end > y;
+    };
+    int rows = rowCount();
+    int first = rows ? std::clamp(int(std::floor((y - m_rowHeight) / pitch)), 0, rows) : 0;
+    while (first > 0 && endsAfter(first - 1))
+        first--;
+    while (first < rows && !endsAfter(first))
+        first++;
+    return first;
+}
+
+int FlexGridLayout::rowsStartingBefore(qreal y, bool inclusive) const
+{
+    qreal pitch = m_rowHeight + m_params.vSpacing;
+    auto startsBefore = [&](int r) { return inclusive ? r * pitch <= y : r * pitch < y; };
+    int rows = rowCount();
+    int count = rows ? std::clamp(int(std::floor(y / pitch)), 0, rows) : 0;
+    while (count > 0 && !startsBefore(count - 1))
+        count--;
+    while (count < rows && startsBefore(count))
+        count++;
+    return count;
+}
+
+int FlexGridLayout::indexAtX(const FlexRow &row, qreal x, bool nearest) const
+{
+    qreal pitch = m_itemWidth + m_params.hSpacing;
+    int column = int(std::floor(x / pitch));
+    if (column >= 0 && x >= (column + 1) * pitch)
+        column++;
+    else if (column > 0 && x < column * pitch)
+        column--;
+    if (column < 0)
+        return nearest ? row.start : -1;
+    if (column > row.end - row.start)
+        return nearest ? row.end : -1;
+
+    // In the cell, or the spacing after it
+    qreal dist = x - (column * pitch + m_itemWidth);
+    if (dist < 0)
+        return row.start + column;
+    if (!nearest)
+        return -1;
+    bool before = row.start + column == row.end || dist <= (column + 1) * pitch - x;
+    return before ? row.start + column : row.start + column + 1;
+}
+
+QRectF FlexGridLayout::geometryOf(int index) const
+{
+    int r = rowForIndex(index);
+    if (r < 0)
+        return QRectF();
+    int column = index - r * m_columns;
+    return QRectF(column * (m_itemWidth + m_params.hSpacing), r * (m_rowHeight + m_params.vSpacing), m_itemWidth, m_rowHeight);
+}
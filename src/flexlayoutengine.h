@@ -0,0 +1,205 @@
+#pragma once
+
+#include "gapbuffer.h"
+#include <QLoggingCategory>
+#include <QRectF>
+#include <QVector>
+
+struct FlexRow
+{
+    int start;
+    int end; // inclusive
+    int prev; // only meaningful _during_ layout
+    qreal ratio;
+    qreal height;
+    qreal cost;
+    qreal y; // only meaningful _after_ layout
+
+    FlexRow() = default;
+    FlexRow(int start)
+        : start(start), end(-1), prev(-1), ratio(0), height(0), cost(0), y(0)
+    {
+    }
+};
+
+// Q_DECLARE_TYPEINFO only necessary for Qt < 5.11
+Q_DECLARE_TYPEINFO(FlexRow, Q_PRIMITIVE_TYPE | Q_MOVABLE_TYPE | Q_RELOCATABLE_TYPE);
+Q_STATIC_ASSERT(!QTypeInfo<FlexRow>::isComplex);
+Q_STATIC_ASSERT(QTypeInfo<FlexRow>::isRelocatable);
+
+struct FlexLayoutParams
+{
+    qreal viewportWidth = 0;
+    qreal hSpacing = 0;
+    qreal vSpacing = 0;
+    qreal minHeight = 0;
+    qreal idealHeight = 0;
+    qreal maxHeight = 0;
+
+    bool operator==(const FlexLayoutParams &o) const
+    {
+        return viewportWidth == o.viewportWidth && hSpacing == o.hSpacing && vSpacing == o.vSpacing
+            && minHeight == o.minHeight && idealHeight == o.idealHeight && maxHeight == o.maxHeight;
+    }
+    bool operator!=(const FlexLayoutParams &o) const { return !(*this == o); }
+};
+
+// FlexLayoutEngine breaks a section's items into rows. FlexSection owns the item ratios
+// and delegates; the engine keeps the rows of its last layout, or what it needs to build
+// them again, and answers geometry queries on them in O(log n) in the number of rows or
+// better. Positions are relative to the section's contentItem.
+//
+// FlexJustifiedLayout picks row breaks by badness over every item's ratio. FlexGridLayout
+// gives every item the same cell, and computes its rows instead of storing them.
+class FlexLayoutEngine
+{
+public:
+    enum Type
+    {
+        Justified,
+        Grid
+    };
+
+    // Work done by a layout, for FlexViewStats
+    struct Cost
+    {
+        int rowsBuilt = 0;
+        qint64 additions = 0;
+    };
+
+    virtual ~FlexLayoutEngine() = default;
+    virtual Type type() const = 0;
+
+    virtual Cost layout(const FlexLayoutParams &params, int count) = 0;
+    qreal contentHeight() const { return m_contentHeight; }
+
+    // Called as items change between layouts, so the next layout only redoes what they
+    // affect. Queries aren't valid again until then.
+    virtual void insertItems(int index, int count) { Q_UNUSED(index); Q_UNUSED(count); }
+    virtual void removeItems(int index, int count) { Q_UNUSED(index); Q_UNUSED(count); }
+    virtual void changeItems(int index, int count) { Q_UNUSED(index); Q_UNUSED(count); }
+    // Free rows that can be built again when they're queried, except for rows from
+    // firstRow up to endRow and the row of index
+    virtual void releaseRowsOutside(int firstRow, int endRow, int index)
+    {
+        Q_UNUSED(firstRow); Q_UNUSED(endRow); Q_UNUSED(index);
+    }
+
+    virtual int rowCount() const = 0;
+    virtual FlexRow row(int r) const = 0;
+    virtual qreal itemWidth(int index, const FlexRow &row) const = 0;
+    // The row containing index, or -1
+    virtual int rowForIndex(int index) const = 0;
+    // The first row that ends after y, or at y if inclusive
+    virtual int firstRowEndingAfter(qreal y, bool inclusive) const = 0;
+    // The number of rows that start before y, or at y if inclusive
+    virtual int rowsStartingBefore(qreal y, bool inclusive) const = 0;
+
+    // The row at y, or -1 if y is in spacing or below the last row. Above the first row is
+    // the first row.
+    int rowAt(qreal y) const;
+    // The index in row at x, or the closest one if nearest; otherwise -1 if there is none
+    virtual int indexAtX(const FlexRow &row, qreal x, bool nearest) const;
+    // An empty rect if index isn't laid out
+    virtual QRectF geometryOf(int index) const;
+
+    virtual qint64 bytes() const { return 0; }
+    virtual void squeeze() {}
+
+protected:
+    FlexLayoutParams m_params;
+    qreal m_contentHeight = 0;
+
+    qreal badness(qreal height) const;
+};
+
+// Large sections are laid out in chunks of up to chunkSize items, so layout time and rows
+// in memory are bounded by the chunk size rather than the section's. Each chunk is laid out
+// as if its items ended the section, and its last row is dropped to start the next chunk
+// instead, so there are no short rows at chunk boundaries. Changes mark the chunks laid out
+// from their items, and the next layout redoes those until a chunk starts where an unchanged
+// one did. Rows of chunks outside of the window are released and built again when needed.
+class FlexJustifiedLayout : public FlexLayoutEngine
+{
+public:
+    static const int chunkSize = 4096;
+
+    // Ratios are read from sizes, which must have one for each item when laying out
+    explicit FlexJustifiedLayout(const GapBuffer<qreal> &sizes);
+
+    Type type() const override { return Justified; }
+    Cost layout(const FlexLayoutParams &params, int count) override;
+    void insertItems(int index, int count) override;
+    void removeItems(int index, int count) override;
+    void changeItems(int index, int count) override;
+    void releaseRowsOutside(int firstRow, int endRow, int index) override;
+
+    int rowCount() const override;
+    FlexRow row(int r) const override;
+    qreal itemWidth(int index, const FlexRow &row) const override { return m_sizes[index] * row.height; }
+    int rowForIndex(int index) const override;
+    int firstRowEndingAfter(qreal y, bool inclusive) const override;
+    int rowsStartingBefore(qreal y, bool inclusive) const override;
+
+    qint64 bytes() const override;
+    void squeeze() override;
+
+    int chunkCount() const { return m_chunks.size(); }
+
+private:
+    struct Chunk
+    {
+        int start = 0;
+        int count = 0;
+        int firstRow = 0;
+        int rowCount = 0;
+        qreal y = 0;
+        // The last row's, so the chunk's bottom rounds exactly as the row's
+        qreal lastRowY = 0;
+        qreal lastRowHeight = 0;
+        bool dirty = false;
+        // Relative to start and y; empty when released
+        mutable QVector<FlexRow> rows;
+    };
+
+    const GapBuffer<qreal> &m_sizes;
+    QVector<Chunk> m_chunks;
+    int m_count = 0;
+
+    Cost layoutRange(int first, int end, QVector<FlexRow> &rows) const;
+    Chunk layoutChunk(int start, Cost &cost) const;
+    const QVector<FlexRow> &rowsOf(const Chunk &chunk) const;
+    void markDirty(int first, int last);
+    int chunkAtRow(int r) const;
+    int chunkAtIndex(int index) const;
+    static qreal bottomOf(const Chunk &chunk) { return chunk.y + chunk.lastRowY + chunk.lastRowHeight; }
+};
+
+class FlexGridLayout : public FlexLayoutEngine
+{
+public:
+    Type type() const override { return Grid; }
+    // Every cell has this ratio
+    void setCellRatio(qreal ratio) { m_ratio = ratio; }
+    Cost layout(const FlexLayoutParams &params, int count) override;
+
+    int rowCount() const override;
+    FlexRow row(int r) const override;
+    qreal itemWidth(int, const FlexRow &) const override { return m_itemWidth; }
+    int rowForIndex(int index) const override;
+    int firstRowEndingAfter(qreal y, bool inclusive) const override;
+    int rowsStartingBefore(qreal y, bool inclusive) const override;
+    int indexAtX(const FlexRow &row, qreal x, bool nearest) const override;
+    QRectF geometryOf(int index) const override;
+
+    int columns() const { return m_columns; }
+
+private:
+    qreal m_ratio = 1;
+    int m_count = 0;
+    int m_columns = 0;
+    qreal m_itemWidth = 0;
+    qreal m_rowHeight = 0;
+};
+
+Q_DECLARE_LOGGING_CATEGORY(lcFlexLayout)
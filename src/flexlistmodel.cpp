@@ -0,0 +1,145 @@
+#include "flexlistmodel.h"
+#include "flextrace.h"
+#include <QMutexLocker>
+
+FlexListModel::FlexListModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+    m_drainTimer.setSingleShot(true);
+    m_drainTimer.setInterval(16);
+    connect(&m_drainTimer, &QTimer::timeout, this, &FlexListModel::drain);
+}
+
+FlexListModel::~FlexListModel()
+{
+}
+
+int FlexListModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return m_items.size();
+}
+
+QHash<int, QByteArray> FlexListModel::roleNames() const
+{
+    return {
+        {SectionRole, "section"},
+        {RatioRole, "ratio"},
+        {SourceRole, "source"},
+        {ValueRole, "value"},
+    };
+}
+
+QVariant FlexListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_items.size())
+        return QVariant();
+
+    const Item &item = m_items[index.row()];
+    switch (role) {
+    case SectionRole:
+        return item.section;
+    case RatioRole:
+        // Missing ratios fall back to FlexView's ratioSourceRole
+        return item.ratio > 0 ? QVariant(item.ratio) : QVariant();
+    case SourceRole:
+        return item.source;
+    case ValueRole:
+        return item.value;
+    }
+    return QVariant();
+}
+
+void FlexListModel::append(const Item &item)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue.append(item);
+    if (m_notified)
+        return;
+    m_notified = true;
+    QMetaObject::invokeMethod(this, &FlexListModel::queued, Qt::QueuedConnection);
+}
+
+void FlexListModel::append(const QVector<Item> &items)
+{
+    if (items.isEmpty())
+        return;
+    QMutexLocker locker(&m_mutex);
+    m_queue.append(items);
+    if (m_notified)
+        return;
+    m_notified = true;
+    QMetaObject::invokeMethod(this, &FlexListModel::queued, Qt::QueuedConnection);
+}
+
+int FlexListModel::queuedCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_queue.size();
+}
+
+// Runs on the GUI thread after the first item is queued since the last drain
+void FlexListModel::queued()
+{
+    if (!m_drainTimer.isActive())
+        m_drainTimer.start();
+    emit itemsQueued();
+}
+
+int FlexListModel::drain()
+{
+    m_drainTimer.stop();
+
+    // The queue keeps its capacity for the producers, and m_items grows by one copy
+    QVector<Item> queue;
+    {
+        QMutexLocker locker(&m_mutex);
+        queue.swap(m_queue);
+        m_queue.reserve(queue.capacity());
+        m_notified = false;
+    }
+    if (queue.isEmpty())
+        return 0;
+
+    FlexTraceScope trace("FlexListModel::drain");
+    trace.arg("count", queue.size());
+    int first = m_items.size();
+    beginInsertRows(QModelIndex(), first, first + queue.size() - 1);
+    if (m_items.isEmpty())
+        m_items.swap(queue);
+    else
+        m_items.append(queue);
+    endInsertRows();
+    emit countChanged();
+    return m_items.size() - first;
+}
+
+void FlexListModel::clear()
+{
+    {
+        // A queued() call may still be pending, but appends must notify again
+        QMutexLocker locker(&m_mutex);
+        m_queue.clear();
+        m_notified = false;
+    }
+    m_drainTimer.stop();
+    beginResetModel();
+    m_items.clear();
+    endResetModel();
+    emit countChanged();
+}
+
+int FlexListModel::drainInterval() const
+{
+    return m_drainTimer.interval();
+}
+
+void FlexListModel::setDrainInterval(int msecs)
+{
+    msecs = std::max(msecs, 0);
+    if (msecs == m_drainTimer.interval())
+        return;
+    m_drainTimer.setInterval(msecs);
+    emit drainIntervalChanged();
+}
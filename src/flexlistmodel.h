@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QAbstractListModel>
+#include <QMutex>
+#include <QTimer>
+#include <QVector>
+
+// FlexListModel is a list model for FlexView that can be filled from worker threads.
+// Producers compute each item's section and ratio, and queue items with append(), which
+// only takes a lock long enough to add them to a buffer. On the GUI thread, drain() swaps
+// the buffer out and inserts everything queued in one rowsInserted, so a view gets one
+// change for each frame rather than one for each item.
+//
+// A FlexView with this model drains it at the start of every layout pass. Otherwise the
+// model drains itself drainInterval ms after the first item is queued.
+class FlexListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+    Q_PROPERTY(int count READ count NOTIFY countChanged)
+    Q_PROPERTY(int drainInterval READ drainInterval WRITE setDrainInterval NOTIFY drainIntervalChanged)
+
+public:
+    enum Roles
+    {
+        SectionRole = Qt::UserRole + 1,
+        RatioRole,
+        SourceRole,
+        ValueRole
+    };
+
+    struct Item
+    {
+        QString section;
+        qreal ratio = 0; // 0 if it's unknown
+        QString source; // a local file path or URL, for ratioSourceRole or tileRole
+        QVariant value;
+    };
+
+    explicit FlexListModel(QObject *parent = nullptr);
+    virtual ~FlexListModel();
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    int count() const { return m_items.size(); }
+    const Item &item(int row) const { return m_items[row]; }
+
+    // Thread-safe
+    void append(const Item &item);
+    void append(const QVector<Item> &items);
+    int queuedCount() const;
+
+    // GUI thread only. Returns the number of rows inserted.
+    Q_INVOKABLE int drain();
+    Q_INVOKABLE void clear();
+
+    int drainInterval() const;
+    void setDrainInterval(int msecs);
+
+signals:
+    void countChanged();
+    void drainIntervalChanged();
+    // Emitted on the GUI thread when items are queued after a drain
+    void itemsQueued();
+
+private:
+    QVector<Item> m_items;
+
+    mutable QMutex m_mutex;
+    QVector<Item> m_queue;
+    bool m_notified = false;
+
+    QTimer m_drainTimer;
+
+    void queued();
+};
@@ -0,0 +1,164 @@
+#include "flexratioprovider.h"
+#include "flextrace.h"
+#include <QImageReader>
+#include <QMutexLocker>
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(lcRatio, "crimson.flexview.ratio")
+
+FlexRatioProvider::FlexRatioProvider(QObject *parent)
+    : QObject(parent)
+{
+}
+
+FlexRatioProvider::~FlexRatioProvider()
+{
+    // Reads in progress refer to this object
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+qreal FlexRatioProvider::ratio(const QString &path, const QModelIndex &index)
+{
+    auto it = m_ratios.constFind(path);
+    if (it != m_ratios.constEnd())
+        return *it;
+
+    auto &waiting = m_waiting[path];
+    if (waiting.isEmpty()) {
+        m_queue.append(path);
+        m_queueSorted = false;
+        scheduleDispatch();
+    }
+    // Layout asks again for rows that are still waiting
+    if (std::find(waiting.cbegin(), waiting.cend(), index) == waiting.cend())
+        waiting.append(index);
+    return 0;
+}
+
+void FlexRatioProvider::setFocusRow(int row)
+{
+    if (row == m_focusRow)
+        return;
+    m_focusRow = row;
+    m_queueSorted = false;
+}
+
+void FlexRatioProvider::cancel()
+{
+    if (!m_queue.isEmpty())
+        qCDebug(lcRatio) << "cancelled" << m_queue.size() << "queued reads";
+    m_queue.clear();
+    m_waiting.clear();
+    m_queueSorted = true;
+}
+
+void FlexRatioProvider::clear()
+{
+    cancel();
+    m_ratios.clear();
+    m_ratios.squeeze();
+    m_cacheBytes = 0;
+}
+
+// Reads are started from the event loop, so that a layout pass queues all of its rows
+// before they're sorted by distance from the focus row
+void FlexRatioProvider::scheduleDispatch()
+{
+    if (m_dispatchQueued)
+        return;
+    m_dispatchQueued = true;
+    QMetaObject::invokeMethod(this, &FlexRatioProvider::dispatch, Qt::QueuedConnection);
+}
+
+void FlexRatioProvider::dispatch()
+{
+    m_dispatchQueued = false;
+    if (m_queue.isEmpty())
+        return;
+
+    // Nearest paths go last in the queue, which is taken from the back. Paths whose rows
+    // are all gone are dropped.
+    if (!m_queueSorted) {
+        QVector<QPair<int, QString>> keyed;
+        keyed.reserve(m_queue.size());
+        for (const QString &path : qAsConst(m_queue)) {
+            int distance = -1;
+            for (const auto &index : m_waiting.value(path)) {
+                if (index.isValid() && (distance < 0 || std::abs(index.row() - m_focusRow) < distance))
+                    distance = std::abs(index.row() - m_focusRow);
+            }
+            if (distance >= 0)
+                keyed.append({distance, path});
+            else
+                m_waiting.remove(path);
+        }
+        std::sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+        m_queue.resize(keyed.size());
+        for (int i = 0; i < keyed.size(); i++)
+            m_queue[i] = keyed[i].second;
+        m_queueSorted = true;
+    }
+
+    int maxRunning = std::max(m_pool.maxThreadCount(), 1) * 2;
+    while (m_running < maxRunning && !m_queue.isEmpty()) {
+        QString path = m_queue.takeLast();
+        m_running++;
+        m_pool.start(QRunnable::create([this, path] {
+            qreal ratio = readRatio(path);
+            QMutexLocker locker(&m_mutex);
+            m_results.append({path, ratio});
+            if (!m_deliveryQueued) {
+                m_deliveryQueued = true;
+                QMetaObject::invokeMethod(this, &FlexRatioProvider::deliver, Qt::QueuedConnection);
+            }
+        }));
+    }
+}
+
+void FlexRatioProvider::deliver()
+{
+    QVector<QPair<QString, qreal>> results;
+    {
+        QMutexLocker locker(&m_mutex);
+        results.swap(m_results);
+        m_deliveryQueued = false;
+    }
+
+    QVector<int> rows;
+    for (const auto &result : qAsConst(results)) {
+        m_running--;
+        if (!m_ratios.contains(result.first)) {
+            m_ratios.insert(result.first, result.second);
+            m_cacheBytes += sizeof(qreal) + sizeof(QString) + result.first.size() * sizeof(QChar);
+        }
+        for (const auto &index : m_waiting.take(result.first)) {
+            if (index.isValid())
+                rows.append(index.row());
+        }
+    }
+    dispatch();
+
+    if (rows.isEmpty())
+        return;
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    qCDebug(lcRatio) << "loaded ratios for" << rows.size() << "rows," << m_queue.size() << "queued";
+    emit ratiosLoaded(rows);
+}
+
+// Runs on a pool thread. Only the header is read; files that can't be read get a ratio
+// of 1, like rows without a ratio in the model.
+qreal FlexRatioProvider::readRatio(const QString &path)
+{
+    FLEX_TRACE_SCOPE("FlexRatioProvider::readRatio");
+    QImageReader reader(path);
+    QSize size = reader.size();
+    if (size.isEmpty()) {
+        qCDebug(lcRatio) << "cannot read image size from" << path << reader.errorString();
+        return 1;
+    }
+    if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+        size.transpose();
+    return qreal(size.width()) / size.height();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QPersistentModelIndex>
+#include <QThreadPool>
+#include <QVector>
+#include <QLoggingCategory>
+
+// FlexRatioProvider reads aspect ratios from the headers of local image files, for models
+// that don't have them. Reads run on a thread pool, starting with rows nearest to the focus
+// row, and finished rows are reported in batches with ratiosLoaded. Ratios are cached by
+// path, so rows sharing a file or coming back later don't read it again.
+class FlexRatioProvider : public QObject
+{
+    Q_OBJECT
+
+public:
+    FlexRatioProvider(QObject *parent = nullptr);
+    virtual ~FlexRatioProvider();
+
+    // The ratio of the file, or 0 if it's unknown and a read was queued for index
+    qreal ratio(const QString &path, const QModelIndex &index);
+    void setFocusRow(int row);
+
+    // Drop queued reads and the rows waiting for them; reads in progress are cached
+    void cancel();
+    // Also drop cached ratios
+    void clear();
+
+    int cachedCount() const { return m_ratios.size(); }
+    qint64 cacheBytes() const { return m_cacheBytes; }
+
+signals:
+    // Rows that have a ratio now, sorted and unique
+    void ratiosLoaded(const QVector<int> &rows);
+
+private:
+    QThreadPool m_pool;
+    QHash<QString, qreal> m_ratios;
+    qint64 m_cacheBytes = 0;
+    // Rows waiting for each queued or running path
+    QHash<QString, QVector<QPersistentModelIndex>> m_waiting;
+    QVector<QString> m_queue;
+    bool m_queueSorted = true;
+    bool m_dispatchQueued = false;
+    int m_running = 0;
+    int m_focusRow = 0;
+
+    // Finished reads, from pool threads
+    QMutex m_mutex;
+    QVector<QPair<QString, qreal>> m_results;
+    bool m_deliveryQueued = false;
+
+    void scheduleDispatch();
+    void dispatch();
+    void deliver();
+    static qreal readRatio(const QString &path);
+};
+
+Q_DECLARE_LOGGING_CATEGORY(lcRatio)
@@ -1,56 +1,12 @@
 #include "flexsection.h"
+#include "flextilelayer.h"
+#include "flextrace.h"
 #include <QtQuick/private/qquickitem_p.h>
 
 // FlexSection contains a range of rows to be laid out as a discrete section. It manages
 // layout geometry and delegates within its range.
 
 Q_LOGGING_CATEGORY(lcSection, "crimson.flexview.section")
-Q_LOGGING_CATEGORY(lcFlexLayout, "crimson.flexview.layout.flex", QtWarningMsg)
-
-#if 0
-#define DEBUG_LAYOUT() qCDebug(lcFlexLayout)
-#define DEBUGGING_LAYOUT
-#else
-#define DEBUG_LAYOUT() if (false) qCDebug(lcFlexLayout)
-#endif
-
-struct ModelData
-{
-    DelegateRef delegate;
-    qreal size;
-
-    ModelData()
-        : size(0)
-    {
-    }
-
-    ModelData(const ModelData &) = delete;
-    ModelData &operator=(const ModelData &) = delete;
-    ModelData(ModelData &&) = default;
-};
-
-struct FlexRow
-{
-    int start;
-    int end; // inclusive
-    // XXX could make this double as a useful value (y?) after layout
-    int prev; // only meaningful _during_ layout
-    qreal ratio;
-    qreal height;
-    qreal cost;
-
-    FlexRow() = default;
-    FlexRow(int start)
-        : start(start), end(-1), prev(-1), ratio(0), height(0), cost(0)
-    {
-    }
-};
-
-// Q_DECLARE_TYPEINFO only necessary for Qt < 5.11
-Q_DECLARE_TYPEINFO(FlexRow, Q_PRIMITIVE_TYPE | Q_MOVABLE_TYPE | Q_RELOCATABLE_TYPE);
-Q_STATIC_ASSERT(!QTypeInfo<FlexRow>::isComplex);
-Q_STATIC_ASSERT(QTypeInfo<FlexRow>::isRelocatable);
-
 FlexSection::FlexSection(FlexViewPrivate *view, const QString &value)
     : QObject(view)
     , view(view)
@@ -63,6 +19,21 @@ FlexSection::~FlexSection()
     clear();
 }
 
+void FlexSection::updateViewStart() const
+{
+    if (view->sectionIndexDirty)
+        view->updateSectionIndex();
+    if (position >= 0)
+        m_viewStart = view->sectionCounts.prefix(position);
+    m_viewStartGeneration = view->sectionGeneration;
+}
+
+void FlexSection::setViewStart(int start)
+{
+    Q_ASSERT(position < 0);
+    m_viewStart = start;
+}
+
 void FlexSection::clear()
 {
     m_currentItem = nullptr;
@@ -72,17 +43,74 @@ void FlexSection::clear()
     m_lastSectionCount = 0;
     count = 0;
     currentIndex =- 1;
-    layoutRows.clear();
-    m_data.clear();
+    m_engine.reset();
+    m_sizes.clear();
+    m_uniformRatio = 0;
+    m_unknownSizes.clear();
+    m_compact = true;
+    m_delegates.clear();
     dirty = 0;
 }
 
+// Drop sizes and rows, keeping the height from the last layout to scale by changes in
+// count until the section is laid out again. Only sections without items are compacted.
+void FlexSection::compact()
+{
+    Q_ASSERT(!m_sectionItem && currentIndex < 0);
+    if (m_compact)
+        return;
+    if (!(dirty & DirtyFlag::Geometry)) {
+        m_lastSectionHeight = m_height;
+        m_lastSectionCount = count;
+    }
+    m_engine.reset();
+    m_sizes.clear();
+    m_uniformRatio = 0;
+    m_unknownSizes.clear();
+    m_delegates.clear();
+    m_compact = true;
+    dirty |= DirtyFlag::Data;
+    m_windowEnd = -1;
+    view->stats->current.sectionsCompacted++;
+    updateHeight();
+}
+
+// std::map nodes hold the value along with three pointers and a color
+qint64 FlexSection::itemDataBytes() const
+{
+    qint64 nodeBytes = sizeof(std::pair<const int, DelegateRef>) + 4 * sizeof(void*);
+    return qint64(m_sizes.capacity()) * sizeof(qreal) + m_unknownSizes.bytes() + qint64(m_delegates.size()) * nodeBytes;
+}
+
+qint64 FlexSection::rowBytes() const
+{
+    return m_engine ? m_engine->bytes() : 0;
+}
+
+void FlexSection::squeeze()
+{
+    m_sizes.squeeze();
+    if (m_engine)
+        m_engine->squeeze();
+}
+
 void FlexSection::insert(int i, int c)
 {
     Q_ASSERT(i >= 0 && i <= count);
     adjustIndex(i, c);
+    if (m_uniformRatio) {
+        // Uniform sections load the new sizes in the next layout, and stay uniform if they match
+        m_unknownSizes.insert(i, c);
+        m_unknownSizes.select(i, i + c - 1);
+    } else if (!m_compact) {
+        m_sizes.insert(i, c);
+    }
+    if (m_engine)
+        m_engine->insertItems(i, c);
     count += c;
+    view->sectionCountChanged(this, c);
     dirty |= DirtyFlag::Indices;
+    updateHeight();
 }
 
 void FlexSection::remove(int i, int c)
@@ -91,8 +119,16 @@ void FlexSection::remove(int i, int c)
     Q_ASSERT(c >= 0);
     Q_ASSERT(i+c <= count);
     adjustIndex(i, -c);
+    if (m_uniformRatio)
+        m_unknownSizes.remove(i, c);
+    else if (!m_compact)
+        m_sizes.remove(i, c);
+    if (m_engine)
+        m_engine->removeItems(i, c);
     count -= c;
+    view->sectionCountChanged(this, -c);
     dirty |= DirtyFlag::Indices;
+    updateHeight();
 }
 
 void FlexSection::change(int i, int c)
@@ -101,50 +137,127 @@ void FlexSection::change(int i, int c)
     Q_ASSERT(c >= 0);
     Q_ASSERT(i+c <= count);
 
+    // Sizes are loaded from the model when a compact section is laid out
+    if (m_compact) {
+        dirty |= DirtyFlag::Data;
+        return;
+    }
+
+    // Tiles take their image when they're laid out
+    if (!view->tileRole.isEmpty())
+        m_windowEnd = -1;
+    // Ratios don't change the size of cells
+    if (m_cellRatio)
+        return;
+
     for (int j = i; j < i+c; j++) {
-        ModelData &data = indexData(j);
         qreal size = view->indexFlexRatio(mapToView(j));
-        if (size != data.size) {
-            data.size = size;
+        if (size != sizeAt(j)) {
+            setSize(j, size);
             dirty |= DirtyFlag::Data;
         }
     }
+    updateHeight();
+}
+
+ModelData FlexSection::takeData(int i)
+{
+    Q_ASSERT(i >= 0 && i < count);
+    ModelData data;
+    if (!m_compact) {
+        data.size = sizeAt(i);
+        setSize(i, 0);
+    }
+    auto node = m_delegates.extract(i);
+    if (!node.empty())
+        data.delegate = std::move(node.mapped());
+    return data;
+}
+
+void FlexSection::putData(int i, ModelData &&data)
+{
+    Q_ASSERT(i >= 0 && i < count);
+    adoptDelegate(data.delegate);
+    if (!m_compact)
+        setSize(i, data.size);
+    if (data.delegate)
+        m_delegates.insert_or_assign(i, std::move(data.delegate));
+    else
+        m_delegates.erase(i);
+    dirty |= DirtyFlag::Data;
+    updateHeight();
+}
+
+// Delegates are owned by their section's contentItem, so they must be reparented when
+// their data moves to another section. Without a section item, the delegate is released;
+// section items only exist near the viewport and for the current section.
+void FlexSection::adoptDelegate(DelegateRef &delegate)
+{
+    if (!delegate)
+        return;
+    if (!m_sectionItem || !m_sectionItem->contentItem()) {
+        delegate.reset();
+        return;
+    }
+    QQml_setParent_noEvent(delegate.get(), m_sectionItem->contentItem());
+    delegate->setParentItem(m_sectionItem->contentItem());
+}
+
+// Move count rows at i to other at index to, along with their data. The rows are
+// inserted in other and removed from this section.
+void FlexSection::moveRows(int i, int c, FlexSection *other, int to)
+{
+    Q_ASSERT(other != this);
+    Q_ASSERT(i >= 0 && c >= 0 && i + c <= count);
+
+    other->insert(to, c);
+    if (!m_compact && !other->m_compact) {
+        for (int j = 0; j < c; j++)
+            other->setSize(to + j, sizeAt(i + j));
+    }
+    auto it = m_delegates.lower_bound(i);
+    while (it != m_delegates.end() && it->first < i + c) {
+        auto node = m_delegates.extract(it++);
+        node.key() += to - i;
+        other->adoptDelegate(node.mapped());
+        if (node.mapped())
+            other->m_delegates.insert(std::move(node));
+    }
+    if (c)
+        remove(i, c);
 }
 
 void FlexSection::adjustIndex(int from, int delta)
 {
-    auto it = m_data.lower_bound(from);
-    if (!delta || it == m_data.end())
+    if (!delta)
         return;
 
     if (currentIndex >= from) {
-        if (delta < 0 && from - currentIndex < delta)
+        if (delta < 0 && currentIndex < from - delta)
             setCurrentIndex(-1);
         else
             currentIndex += delta;
     }
 
+    // Sizes are shifted by insert() and remove(). Delegates are only kept for rows around
+    // the visible area, so re-keying them costs at most as many as are live.
+    auto it = m_delegates.lower_bound(from);
+    if (delta < 0)
+        it = m_delegates.erase(it, m_delegates.lower_bound(from - delta));
+
+    // Re-key nodes in place; shifting up has to start from the end to avoid collisions
     if (delta > 0) {
-        auto first = it;
-        it = m_data.end();
-
-        for (;;) {
-            auto prev = it;
-            it--;
-            int nkey = it->first + delta;
-            m_data.insert(prev, std::move(*it));
-            if (it == first) {
-                m_data.erase(it);
-                break;
-            }
-            it = m_data.erase(it);
+        auto next = m_delegates.end();
+        while (next != m_delegates.begin() && std::prev(next)->first >= from) {
+            auto node = m_delegates.extract(std::prev(next));
+            node.key() += delta;
+            next = m_delegates.insert(next, std::move(node));
         }
     } else {
-        while (it != m_data.end()) {
-            int nkey = it->first + delta;
-            if (nkey >= from)
-                m_data.insert(it, std::move(*it));
-            it = m_data.erase(it);
+        while (it != m_delegates.end()) {
+            auto node = m_delegates.extract(it++);
+            node.key() += delta;
+            m_delegates.insert(it, std::move(node));
         }
     }
 }
@@ -155,6 +268,7 @@ bool FlexSection::setViewportWidth(qreal width)
         return false;
     viewportWidth = width;
     dirty |= DirtyFlag::Geometry;
+    updateHeight();
     return true;
 }
 
@@ -165,6 +279,7 @@ bool FlexSection::setSpacing(qreal horizontal, qreal vertical)
     vSpacing = vertical;
     hSpacing = horizontal;
     dirty |= DirtyFlag::Geometry;
+    updateHeight();
     return true;
 }
 
@@ -176,6 +291,26 @@ bool FlexSection::setIdealHeight(qreal min, qreal ideal, qreal max)
     idealHeight = ideal;
     maxHeight = max;
     dirty |= DirtyFlag::Geometry;
+    updateHeight();
+    return true;
+}
+
+bool FlexSection::setCellRatio(qreal ratio)
+{
+    if (m_cellRatio == ratio)
+        return false;
+    m_cellRatio = ratio;
+    // Sizes are all the cell ratio in a grid, and loaded again from the model without one
+    if (!m_compact) {
+        m_sizes.clear();
+        m_unknownSizes.clear();
+        m_uniformRatio = ratio;
+        if (!ratio)
+            m_sizes.insert(0, count);
+        m_engine.reset();
+    }
+    dirty |= DirtyFlag::Data | DirtyFlag::Geometry;
+    updateHeight();
     return true;
 }
 
@@ -188,6 +323,11 @@ void FlexSection::setCurrentIndex(int index)
 
     int oldIndex = currentIndex;
     currentIndex = index;
+    // The next layoutDelegates has to position the new current item
+    m_windowEnd = -1;
+    // Tiles only have a delegate for the current item, and the old one is drawn as a tile
+    if (!view->tileRole.isEmpty() && oldIndex >= 0)
+        releaseDelegates(oldIndex, oldIndex);
     if (currentIndex >= 0) {
         ensureItem();
         m_currentItem = delegate(index, true);
@@ -210,32 +350,136 @@ QQuickItem *FlexSection::currentItem()
 }
 
 // Return the actual section item height, if it exists.
-// Otherwise, guess based on the last known heights
-// If it has never existed, make a guess based on idealHeight
-// In all cases, use at least 10 pixels.
+// Otherwise, use the laid out content height if it's current,
+// or scale the last known height by the change in count.
+// If it has never been laid out, estimate rows from the view's
+// mean ratio. In all cases, use at least 10 pixels.
 //
-// The exact values here are not as important; when the section
-// item doesn't exist, they're primarily just for contentHeight
-// scrolling estimates. It is important to have at least 1px for
-// the visble/cache area to intersect.
+// Estimates position everything after the section until it is
+// near the viewport, so they should be close to the real height.
+// It is important to have at least 1px for the visible/cache area
+// to intersect.
 qreal FlexSection::estimatedHeight() const
 {
     qreal estimate = 0;
     if (m_sectionItem && m_sectionItem->item()) {
         estimate = m_sectionItem->item()->height();
-    } else if (m_lastSectionHeight > 0 && m_lastSectionCount > 0) {
+    } else if (!dirty && rowCount() > 0) {
+        estimate = m_contentHeight + view->sectionHeaderHeight;
+    } else if (!(dirty & DirtyFlag::Geometry) && m_lastSectionHeight > 0 && m_lastSectionCount > 0) {
         int delta = count - m_lastSectionCount;
         estimate = m_lastSectionHeight + ((m_lastSectionHeight / m_lastSectionCount) * delta);
-    } else if (idealHeight > 0 && count > 0 && viewportWidth > 0) {
-        // Estimate items per row based on idealHeight, viewportWidth, and
-        // an assumption that everything is 4:3
-        int itemsPerRow = std::round(viewportWidth / (idealHeight * (4 / 3)));
-        estimate = std::ceil(double(count) / itemsPerRow) * idealHeight;
+    } else {
+        estimate = view->estimateRowsHeight(count) + view->sectionHeaderHeight;
     }
 
     return std::max(10., estimate);
 }
 
+// Keep view->sectionHeights in sync after anything that affects estimatedHeight. Sections
+// outside of the list are updated when they're inserted.
+void FlexSection::updateHeight()
+{
+    if (position < 0)
+        return;
+    qreal height = estimatedHeight();
+    if (height == m_height)
+        return;
+    qreal delta = height - m_height;
+    m_height = height;
+    view->sectionHeightChanged(this, delta);
+}
+
+// The size of row i, or 0 if it isn't loaded
+qreal FlexSection::sizeAt(int i) const
+{
+    Q_ASSERT(!m_compact && i >= 0 && i < count);
+    if (m_uniformRatio)
+        return m_unknownSizes.contains(i) ? 0 : m_uniformRatio;
+    return m_sizes[i];
+}
+
+void FlexSection::setSize(int i, qreal size)
+{
+    Q_ASSERT(!m_compact && i >= 0 && i < count);
+    if (!m_uniformRatio) {
+        m_sizes[i] = size;
+    } else if (size == m_uniformRatio) {
+        m_unknownSizes.deselect(i, i);
+    } else if (!size) {
+        m_unknownSizes.select(i, i);
+    } else {
+        materializeSizes();
+        m_sizes[i] = size;
+    }
+    if (m_engine)
+        m_engine->changeItems(i, 1);
+}
+
+// Store a size for every row again, when a uniform section gets a different one
+void FlexSection::materializeSizes()
+{
+    Q_ASSERT(m_uniformRatio && m_sizes.isEmpty());
+    m_sizes.insert(0, count);
+    for (int i = 0; i < count; i++)
+        m_sizes[i] = m_uniformRatio;
+    for (const auto &range : m_unknownSizes.ranges()) {
+        for (int i = range.first; i <= range.second; i++)
+            m_sizes[i] = 0;
+    }
+    m_uniformRatio = 0;
+    m_unknownSizes.clear();
+}
+
+qreal FlexSection::loadSize(int i) const
+{
+    if (m_cellRatio)
+        return m_cellRatio;
+    qreal size = view->indexFlexRatio(mapToView(i));
+    return size ? size : 1;
+}
+
+// Load every size that isn't known yet, and return their sum. When they're all the same,
+// only the ratio is kept.
+qreal FlexSection::loadSizes()
+{
+    if (m_uniformRatio) {
+        const auto unknown = m_unknownSizes.ranges();
+        for (const auto &range : unknown) {
+            for (int i = range.first; i <= range.second; i++) {
+                qreal size = loadSize(i);
+                if (size == m_uniformRatio)
+                    continue;
+                m_unknownSizes.deselect(unknown.first().first, i - 1);
+                materializeSizes();
+                m_sizes[i] = size;
+                break;
+            }
+            if (!m_uniformRatio)
+                break;
+        }
+        if (m_uniformRatio) {
+            m_unknownSizes.clear();
+            return m_uniformRatio * count;
+        }
+    }
+
+    bool uniform = true;
+    qreal ratioSum = 0;
+    for (int i = 0; i < count; i++) {
+        qreal &size = m_sizes[i];
+        if (!size)
+            size = loadSize(i);
+        ratioSum += size;
+        uniform = uniform && size == m_sizes[0];
+    }
+    if (uniform && count > 0) {
+        m_uniformRatio = m_sizes[0];
+        m_sizes.clear();
+    }
+    return ratioSum;
+}
+
 bool FlexSection::layout()
 {
     if (!dirty)
@@ -246,137 +490,92 @@ bool FlexSection::layout()
         idealHeight = -1;
     }
 
-    layoutRows.clear();
+    if (m_compact) {
+        // Fixed cells don't need each item's ratio
+        if (m_cellRatio)
+            m_uniformRatio = m_cellRatio;
+        else
+            m_sizes.insert(0, count);
+        m_compact = false;
+        view->sectionLoaded(this);
+    }
+
     m_contentHeight = 0;
+    m_windowEnd = -1;
     if (viewportWidth < 1 || minHeight < 1 || idealHeight < 1 || maxHeight < 1) {
+        m_engine.reset();
         dirty.setFlag(DirtyFlag::Geometry, false);
+        updateHeight();
         return true;
     } else if (count < 1) {
+        m_engine.reset();
         dirty.setFlag(DirtyFlag::Indices, false);
+        updateHeight();
         return true;
     }
 
+    FlexTraceScope trace("FlexSection::layout");
+    trace.arg("viewStart", viewStart());
+    trace.arg("count", count);
     QElapsedTimer tm;
     tm.restart();
 
-    std::vector<FlexRow> rows;
-    std::vector<FlexRow> openRows{FlexRow(0)};
-    int nAdditions = 0;
-
-    DEBUG_LAYOUT() << "layout for section viewStart" << viewStart << "count" << count << "dirty" << dirty;
-
-    // XXX oof, this is redoing layout for every data change because the size role may have changed..
-    // a cache could save a lot of pain
-
-    for (int i = 0; i < count; i++) {
-        auto &data = indexData(i);
-        if (!data.size) {
-            data.size = view->indexFlexRatio(mapToView(i));
-            if (!data.size)
-                data.size = 1;
-        }
-
-        FlexRow addingRow(0);
-        Q_ASSERT(!openRows.empty());
-        for (auto it = openRows.begin(); it != openRows.end(); ) {
-            FlexRow &candidate = *it;
-            candidate.ratio += data.size;
-            candidate.height = (viewportWidth - (hSpacing * (i - candidate.start))) / candidate.ratio;
-            nAdditions++;
-
-            if (candidate.height > maxHeight && i+1 < count) {
-                it++;
-                continue;
-            } else if (candidate.height < minHeight && candidate.end >= 0) {
-                // Below minimum height, and at least one candidate has been recorded with this start index
-                DEBUG_LAYOUT() << ".... no more rows start at" << candidate.start << "because adding"
-                    << i << "reduces height to" << candidate.height << "with minimum" << minHeight;
-                it = openRows.erase(it);
-                continue;
-            } else {
-                qreal cost = candidate.cost + badness(candidate);
-                candidate.end = i;
-
-                if (addingRow.end < 0 || cost < addingRow.cost) {
-                    addingRow = candidate;
-                    addingRow.cost = cost;
-
-                    if (addingRow.height > maxHeight) {
-                        // Set last partial row to idealHeight, but keep original badness
-                        addingRow.height = idealHeight;
-                    } else if (addingRow.height < minHeight) {
-                        // XXX if i > row.start, the candidate ending at i-1 was just as viable.
-                        // There was no way to know that at the time, and adding it now is complex.
-                        // XXX revisit how complex that actually is... can candidate be changed back?
-                        it = openRows.erase(it);
-                        continue;
-                    }
-                }
-
-                it++;
-                continue;
-            }
-
-            Q_UNREACHABLE();
-        }
-
-        if (addingRow.end >= 0) {
-            DEBUG_LAYOUT() << ".. row:" << addingRow.start << "to" << addingRow.end << "height" << addingRow.height
-                << "ratio" << addingRow.ratio << "badness" << badness(addingRow) << "cost" << addingRow.cost;
-            rows.push_back(addingRow);
-
-            if (addingRow.height < minHeight) {
-                DEBUG_LAYOUT() << ".... row of height" << addingRow.height << "is below minimum" << minHeight << "but no other rows could start from" << addingRow.start;
-            }
-
-            FlexRow next(i+1);
-            next.cost = addingRow.cost;
-            next.prev = rows.size() - 1;
-            openRows.push_back(next);
-        }
-    }
-
-    for (int i = rows.size() - 1; i >= 0; i = rows[i].prev) {
-        layoutRows.append(rows[i]);
-        m_contentHeight += rows[i].height;
+    // Sections of one ratio are laid out as a grid, whatever the view's engine
+    qreal ratioSum = loadSizes();
+    FlexLayoutEngine::Type type = m_uniformRatio ? FlexLayoutEngine::Grid : FlexLayoutEngine::Justified;
+    if (!m_engine || m_engine->type() != type) {
+        if (type == FlexLayoutEngine::Grid)
+            m_engine.reset(new FlexGridLayout);
+        else
+            m_engine.reset(new FlexJustifiedLayout(m_sizes));
     }
-    std::reverse(layoutRows.begin(), layoutRows.end());
-    Q_ASSERT(!layoutRows.isEmpty());
-    Q_ASSERT(layoutRows[0].start == 0);
-    m_contentHeight += vSpacing * (layoutRows.size() - 1);
-
-#ifdef DEBUGGING_LAYOUT
-    if (lcFlexLayout().isDebugEnabled()) {
-        qCDebug(lcFlexLayout) << ".. selected rows:";
-        for (const auto &row : layoutRows) {
-            qCDebug(lcFlexLayout) << "...." << row.start << "to" << row.end << "cost" << row.cost << "height" << row.height;
-        }
+    if (type == FlexLayoutEngine::Grid)
+        static_cast<FlexGridLayout*>(m_engine.data())->setCellRatio(m_uniformRatio);
+    trace.arg("grid", type == FlexLayoutEngine::Grid);
+
+    FlexLayoutParams params;
+    params.viewportWidth = viewportWidth;
+    params.hSpacing = hSpacing;
+    params.vSpacing = vSpacing;
+    params.minHeight = minHeight;
+    params.idealHeight = idealHeight;
+    params.maxHeight = maxHeight;
+    FlexLayoutEngine::Cost cost = m_engine->layout(params, count);
+    m_contentHeight = m_engine->contentHeight();
+
+    qint64 layoutNsecs = tm.nsecsElapsed();
+    if (type == FlexLayoutEngine::Grid) {
+        view->stats->gridLaidOut(layoutNsecs);
+        qCDebug(lcLayout) << "section:" << rowCount() << "rows of" << static_cast<FlexGridLayout*>(m_engine.data())->columns()
+            << "for" << count << "items starting" << viewStart() << "in" << m_contentHeight << "px in" << (layoutNsecs / 1000000) << "ms";
+    } else {
+        view->stats->sectionLaidOut(layoutNsecs, cost.rowsBuilt, cost.additions);
+        qCDebug(lcLayout) << "section:" << rowCount() << "rows for" << count << "items starting" << viewStart() << "in" << m_contentHeight
+            << "px; built" << cost.rowsBuilt << "rows from" << cost.additions << "additions in" << (layoutNsecs / 1000000) << "ms";
     }
-#endif
-
-    qCDebug(lcLayout) << "section:" << layoutRows.size() << "rows for" << count << "items starting" << viewStart << "in" << m_contentHeight << "px; built" << rows.size() << "rows from" << nAdditions << "additions in" << tm.elapsed() << "ms";
 
     if (dirty & DirtyFlag::Indices && m_sectionItem)
         emit m_sectionItem->countChanged();
 
+    view->sectionRatiosChanged(this, ratioSum - m_ratioSum, count - m_ratioCount);
+    m_ratioSum = ratioSum;
+    m_ratioCount = count;
+
     dirty = 0;
+    updateHeight();
     return true;
 }
 
-qreal FlexSection::badness(const FlexRow &row) const
+int FlexSection::rowCount() const
 {
-    if (row.height < idealHeight) {
-        return 1 - (row.height - minHeight) / (idealHeight - minHeight);
-    } else if (row.height > idealHeight) {
-        return 1 - (maxHeight - row.height) / (maxHeight - idealHeight);
-    } else {
-        return 0;
-    }
+    return m_engine ? m_engine->rowCount() : 0;
 }
 
 void FlexSection::layoutDelegates(const QRectF &visibleArea, const QRectF &cacheArea)
 {
     Q_ASSERT(!dirty);
+    FlexTraceScope trace("FlexSection::layoutDelegates");
+    trace.arg("viewStart", viewStart());
 
     if (!ensureItem()) {
         qCWarning(lcDelegate) << "failed to create section delegate";
@@ -390,48 +589,43 @@ void FlexSection::layoutDelegates(const QRectF &visibleArea, const QRectF &cache
     contentItem->setSize(QSizeF(viewportWidth, m_contentHeight));
     m_lastSectionHeight = m_sectionItem->item()->height();
     m_lastSectionCount = count;
-
-    qreal y = 0;
-    auto row = layoutRows.constBegin();
-    for (; row != layoutRows.constEnd(); row++) {
-        if (y + row->height >= cacheArea.top())
-            break;
-        if (currentIndex >= row->start && currentIndex <= row->end)
-            layoutRow(*row, y, false);
-        y += row->height + vSpacing;
-    }
-
-    if (row == layoutRows.constEnd()) {
-        releaseDelegates();
-        return;
-    }
-    if (row->start > 0)
-        releaseDelegates(0, row->start - 1);
-
-    for (; row != layoutRows.constEnd(); row++) {
-        Q_ASSERT(y < m_contentHeight);
-        if (y > cacheArea.bottom())
-            break;
-
-        layoutRow(*row, y);
-        y += row->height + vSpacing;
-    }
-
-    // Release the remaining delegates before continuing to layout the current row
-    // if applicable. The current item is not affected by releaseDelegates.
-    if (row != layoutRows.constEnd())
-        releaseDelegates(row->start, -1);
-
-    for (; currentIndex >= 0 && row != layoutRows.constEnd() && currentIndex >= row->start; row++) {
-        if (currentIndex <= row->end) {
-            layoutRow(*row, y, false);
-            break;
+    view->sectionHeaderHeight = std::max(0., m_lastSectionHeight - m_contentHeight);
+    updateHeight();
+
+    // Rows intersecting the cache area
+    int firstRow = firstRowEndingAfter(cacheArea.top(), true);
+    int endRow = std::max(firstRow, rowsStartingBefore(cacheArea.bottom(), true));
+
+    if (!view->tileRole.isEmpty()) {
+        layoutTiles(firstRow, endRow);
+    } else if (m_windowEnd >= 0) {
+        // Nothing changed since the last call except the areas, so rows that were already
+        // in the window are in place. Only rows crossing its edges are created or released.
+        releaseRows(m_windowFirst, std::min(m_windowEnd, firstRow));
+        releaseRows(std::max(m_windowFirst, endRow), m_windowEnd);
+        for (int r = firstRow; r < endRow; r++) {
+            if (r < m_windowFirst || r >= m_windowEnd)
+                layoutRow(row(r));
         }
-        y += row->height + vSpacing;
+    } else {
+        releaseRows(0, firstRow);
+        releaseRows(endRow, rowCount());
+        for (int r = firstRow; r < endRow; r++)
+            layoutRow(row(r));
+
+        // The current item is kept outside of the cache area, but isn't created here
+        int currentRow = currentIndex >= 0 ? rowForIndex(currentIndex) : -1;
+        if (currentRow >= 0 && (currentRow < firstRow || currentRow >= endRow))
+            layoutRow(row(currentRow), false);
     }
+
+    m_windowFirst = firstRow;
+    m_windowEnd = endRow;
+    if (m_engine)
+        m_engine->releaseRowsOutside(firstRow, endRow, currentIndex);
 }
 
-void FlexSection::layoutRow(const FlexRow &row, qreal y, bool create)
+void FlexSection::layoutRow(const FlexRow &row, bool create)
 {
     qreal x = 0;
     QQuickItem *contentItem = m_sectionItem->contentItem();
@@ -440,11 +634,8 @@ void FlexSection::layoutRow(const FlexRow &row, qreal y, bool create)
         if (i > row.start)
             x += hSpacing;
 
-        int viewIndex = mapToView(i);
-        auto &data = indexData(i);
-        qreal width = data.size * row.height;
+        qreal width = itemWidth(i, row);
 
-        // XXX inefficient everywhere
         auto item = delegate(i, create);
         if (!item) {
             x += width;
@@ -452,7 +643,7 @@ void FlexSection::layoutRow(const FlexRow &row, qreal y, bool create)
         }
 
         item->setParentItem(contentItem);
-        item->setPosition(QPointF(x, y));
+        item->setPosition(QPointF(x, row.y));
         item->setSize(QSizeF(width, row.height));
         if (i == currentIndex)
             item->setFocus(true);
@@ -460,48 +651,57 @@ void FlexSection::layoutRow(const FlexRow &row, qreal y, bool create)
     }
 }
 
-int FlexSection::rowAt(qreal target) const
+// In tile mode, rows in the window are drawn by the tile layer, and only the current item
+// has a delegate
+void FlexSection::layoutTiles(int firstRow, int endRow)
 {
-    qreal y = 0;
-    for (int i = 0; i < layoutRows.size(); i++) {
-        y += layoutRows[i].height;
-        if (y > target)
-            return i;
-        y += vSpacing;
-        if (y > target)
-            return -1;
+    QQuickItem *contentItem = m_sectionItem->contentItem();
+    if (!m_tileLayer) {
+        m_tileLayer = new FlexTileLayer(this, contentItem);
+        m_tileLayer->setZ(-1);
+    }
+    m_tileLayer->setSize(QSizeF(viewportWidth, m_contentHeight));
+    if (m_windowEnd >= 0 && firstRow == m_windowFirst && endRow == m_windowEnd)
+        return;
+
+    QVector<FlexTileLayer::Tile> tiles;
+    for (int r = firstRow; r < endRow; r++) {
+        const FlexRow row = this->row(r);
+        qreal x = 0;
+        for (int i = row.start; i <= row.end; i++) {
+            if (i > row.start)
+                x += hSpacing;
+            qreal width = itemWidth(i, row);
+            if (i != currentIndex)
+                tiles.append({i, QRectF(x, row.y, width, row.height), view->tilePath(mapToView(i))});
+            x += width;
+        }
     }
-    return -1;
+    m_tileLayer->setTiles(tiles);
+
+    int currentRow = currentIndex >= 0 ? rowForIndex(currentIndex) : -1;
+    if (currentRow >= 0)
+        layoutRow(row(currentRow), false);
+}
+
+// Release delegates for rows from first up to end, except for the current item. Rows at
+// the ends of the section aren't looked up, so their chunks needn't be built.
+void FlexSection::releaseRows(int first, int end)
+{
+    if (first < end)
+        releaseDelegates(first > 0 ? row(first).start : 0, end < rowCount() ? row(end - 1).end : -1);
+}
+
+int FlexSection::rowAt(qreal target) const
+{
+    return m_engine ? m_engine->rowAt(target) : -1;
 }
 
 int FlexSection::rowIndexAt(int rowIndex, qreal target, bool nearest)
 {
-    if (rowIndex < 0 || rowIndex >= layoutRows.size())
+    if (rowIndex < 0 || rowIndex >= rowCount())
         return -1;
-    qreal x = 0;
-    qreal dist = -1;
-    const FlexRow &row = layoutRows[rowIndex];
-    for (int i = row.start; i <= row.end; i++) {
-        if (i > row.start)
-            x += hSpacing;
-
-        int viewIndex = mapToView(i);
-        auto &data = indexData(i);
-        qreal width = data.size * row.height;
-
-        if (target >= x && target < x + width) {
-            return i;
-        } else if (target < x) {
-            if (nearest)
-                return (dist < 0 || x - target < dist) ? i : i - 1;
-            else
-                break;
-        } else {
-            dist = target - (x + width);
-            x += width;
-        }
-    }
-    return nearest ? row.end : -1;
+    return m_engine->indexAtX(row(rowIndex), target, nearest);
 }
 
 int FlexSection::indexAt(const QPointF &pos)
@@ -511,81 +711,192 @@ int FlexSection::indexAt(const QPointF &pos)
 
 int FlexSection::rowForIndex(int index) const
 {
-    auto it = std::lower_bound(layoutRows.begin(), layoutRows.end(), index, [](const FlexRow &row, int i) { return row.end < i; });
-    if (it == layoutRows.end())
-        return -1;
-    Q_ASSERT(index >= it->start && index <= it->end);
-    return std::distance(layoutRows.begin(), it);
+    return m_engine ? m_engine->rowForIndex(index) : -1;
 }
 
-QRectF FlexSection::geometryOf(int index)
+// The y of contentItem in the section item, or the view's estimate without an item
+qreal FlexSection::contentOffset()
+{
+    if (!m_sectionItem || !m_sectionItem->item())
+        return view->sectionHeaderHeight;
+    return m_sectionItem->contentItem()->mapToItem(m_sectionItem->item(), QPointF()).y();
+}
+
+qreal FlexSection::indexY(int index)
 {
     int rowIndex = rowForIndex(index);
     if (rowIndex < 0)
-        return QRectF();
-    const FlexRow &row = layoutRows[rowIndex];
+        return -1;
+    return contentOffset() + row(rowIndex).y;
+}
 
-    QRectF geom;
-    for (int i = 0; i < rowIndex; i++)
-        geom.setY(geom.y() + layoutRows[i].height + vSpacing);
-    geom.setHeight(row.height);
+// The first index in the first row that ends below y, or -1 if there is none
+int FlexSection::indexAtY(qreal y)
+{
+    int r = firstRowEndingAfter(y - contentOffset(), false);
+    if (r >= rowCount())
+        return -1;
+    return row(r).start;
+}
 
-    for (int i = row.start; i <= index; i++) {
-        if (i > row.start)
-            geom.setX(geom.x() + hSpacing);
+QRectF FlexSection::geometryOf(int index)
+{
+    return m_engine ? m_engine->geometryOf(index) : QRectF();
+}
+
+QVector<QPair<int, QRectF>> FlexSection::geometriesIn(qreal top, qreal bottom) const
+{
+    QVector<QPair<int, QRectF>> items;
+    int end = rowsStartingBefore(bottom, true);
+    for (int r = firstRowEndingAfter(top, true); r < end; r++) {
+        const FlexRow row = this->row(r);
+        qreal x = 0;
+        for (int i = row.start; i <= row.end; i++) {
+            if (i > row.start)
+                x += hSpacing;
+            qreal width = itemWidth(i, row);
+            items.append({i, QRectF(x, row.y, width, row.height)});
+            x += width;
+        }
+    }
+    return items;
+}
+
+// Items of a row that intersect area are contiguous, so each row adds at most one range,
+// which is merged into the last range if it continues it
+void FlexSection::indicesIn(const QRectF &area, QVector<QPair<int, int>> &ranges) const
+{
+    int endRow = rowsStartingBefore(area.bottom(), false);
+    for (int r = firstRowEndingAfter(area.top(), false); r < endRow; r++) {
+        const FlexRow row = this->row(r);
+        int start = -1;
+        int end = -1;
+        qreal x = 0;
+        for (int i = row.start; i <= row.end && x < area.right(); i++) {
+            if (i > row.start)
+                x += hSpacing;
+            qreal width = itemWidth(i, row);
+            if (x < area.right() && x + width > area.left()) {
+                if (start < 0)
+                    start = i;
+                end = i;
+            }
+            x += width;
+        }
+        if (start < 0)
+            continue;
+
+        start = mapToView(start);
+        end = mapToView(end);
+        if (!ranges.isEmpty() && ranges.last().second == start - 1)
+            ranges.last().second = end;
+        else
+            ranges.append({start, end});
+    }
+}
 
+// Compare cached data against the model, and the current layout against one from scratch
+bool FlexSection::validate()
+{
+    bool valid = true;
+    if (m_compact) {
+        if (!m_sizes.isEmpty() || m_uniformRatio || m_engine || !m_delegates.empty()) {
+            qCWarning(lcSection) << "section" << value << "is compact but has sizes, rows or delegates";
+            return false;
+        }
+        return valid;
+    }
+    if (m_sizes.size() != (m_uniformRatio ? 0 : count)) {
+        qCWarning(lcSection) << "section" << value << "has" << m_sizes.size() << "sizes for count" << count << "uniform" << m_uniformRatio;
+        return false;
+    }
+    if (!m_unknownSizes.isEmpty() && (!m_uniformRatio || m_unknownSizes.ranges().last().second >= count)) {
+        qCWarning(lcSection) << "section" << value << "has unknown sizes" << m_unknownSizes.ranges() << "for count" << count;
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
         int viewIndex = mapToView(i);
-        auto &data = indexData(i);
-        qreal width = data.size * row.height;
-        if (i == index) {
-            geom.setWidth(width);
-            break;
+        qreal size = m_cellRatio ? m_cellRatio : view->indexFlexRatio(viewIndex);
+        if (sizeAt(i) && sizeAt(i) != (size ? size : 1)) {
+            qCWarning(lcSection) << "section" << value << "has size" << sizeAt(i) << "for index" << viewIndex << "expected" << size;
+            valid = false;
+        }
+    }
+    for (const auto &entry : m_delegates) {
+        if (entry.first < 0 || entry.first >= count) {
+            qCWarning(lcSection) << "section" << value << "has a delegate for index" << entry.first << "outside of count" << count;
+            valid = false;
+        } else if (entry.second != view->items.item(mapToView(entry.first))) {
+            qCWarning(lcSection) << "section" << value << "has the wrong delegate for index" << mapToView(entry.first);
+            valid = false;
         }
-        geom.setX(geom.x() + width);
     }
 
-    return geom;
+    if (dirty)
+        return valid;
+
+    FlexSection fresh(view, value);
+    fresh.setViewStart(viewStart());
+    fresh.setCellRatio(m_cellRatio);
+    fresh.insert(0, count);
+    fresh.setViewportWidth(viewportWidth);
+    fresh.setSpacing(hSpacing, vSpacing);
+    fresh.setIdealHeight(minHeight, idealHeight, maxHeight);
+    // The reference layout isn't counted in stats, so validating doesn't skew benchmarks
+    const FlexViewStats::Counters counters = view->stats->current;
+    fresh.layout();
+    view->stats->current = counters;
+
+    if (fresh.rowCount() != rowCount() || !qFuzzyCompare(1 + fresh.m_contentHeight, 1 + m_contentHeight)) {
+        qCWarning(lcSection) << "section" << value << "has" << rowCount() << "rows in" << m_contentHeight
+            << "px, expected" << fresh.rowCount() << "rows in" << fresh.m_contentHeight << "px";
+        return false;
+    }
+    for (int i = 0; i < rowCount(); i++) {
+        const FlexRow row = this->row(i);
+        const FlexRow expected = fresh.row(i);
+        if (row.start != expected.start || row.end != expected.end || !qFuzzyCompare(row.height, expected.height)) {
+            qCWarning(lcSection) << "section" << value << "row" << i << "is" << row.start << row.end << row.height
+                << "expected" << expected.start << expected.end << expected.height;
+            return false;
+        }
+    }
+    return valid;
 }
 
-ModelData &FlexSection::indexData(int index)
+DelegateRef FlexSection::delegate(int index, bool create)
 {
     Q_ASSERT(index >= 0);
     Q_ASSERT(index < count);
 
-    auto it = m_data.lower_bound(index);
-    if (it != m_data.end() && it->first == index)
+    auto it = m_delegates.lower_bound(index);
+    if (it != m_delegates.end() && it->first == index)
         return it->second;
 
-    m_data.insert(it, std::make_pair(index, ModelData()));
-    it--;
-    Q_ASSERT(it->first == index);
-    return it->second;
-}
-
-DelegateRef FlexSection::delegate(int index, bool create)
-{
-    auto &data = indexData(index);
-    if (!data.delegate) {
-        // XXX inefficient, queries unnecessarily, but things need reworking around delegates with this anyway
-        if (!create) {
-            data.delegate = view->items.item(mapToView(index));
-        } else {
-            // XXX AsyncIfNested, etc
-            data.delegate = view->items.createItem(mapToView(index), view->delegate, m_sectionItem->contentItem(), QQmlIncubator::Synchronous);
-        }
+    DelegateRef item;
+    // XXX inefficient, queries unnecessarily, but things need reworking around delegates with this anyway
+    if (!create) {
+        item = view->items.item(mapToView(index));
+    } else {
+        // XXX AsyncIfNested, etc
+        item = view->items.createItem(mapToView(index), view->delegate, m_sectionItem->contentItem(), QQmlIncubator::Synchronous);
     }
-
-    return data.delegate;
+    if (item)
+        m_delegates.emplace_hint(it, index, item);
+    return item;
 }
 
 void FlexSection::releaseSectionDelegate()
 {
     Q_ASSERT(!currentItem());
     releaseDelegates();
+    m_windowEnd = -1;
+    m_tileLayer = nullptr;
     if (m_sectionItem) {
         qCDebug(lcDelegate) << "releasing section delegate" << m_sectionItem;
         m_sectionItem->destroy();
         m_sectionItem = nullptr;
+        updateHeight();
     }
 }
 
@@ -594,23 +905,23 @@ void FlexSection::releaseDelegates(int first, int last)
     Q_ASSERT(last < 0 || first <= last);
 
     int released = 0;
-    auto it = m_data.begin();
+    auto it = m_delegates.begin();
     if (first > 0)
-        it = m_data.lower_bound(first);
+        it = m_delegates.lower_bound(first);
 
-    for (; it != m_data.end(); it++) {
+    while (it != m_delegates.end()) {
         if (last >= 0 && it->first > last)
             break;
 
-        // It's not strictly necessary to keep the current item in ModelData, since a ref
+        // It's not strictly necessary to keep the current item in m_delegates, since a ref
         // is held by m_currentItem, but it's not a bad idea.
-        if (it->first == currentIndex)
+        if (it->first == currentIndex) {
+            it++;
             continue;
-
-        if (it->second.delegate) {
-            it->second.delegate.reset();
-            released++;
         }
+
+        it = m_delegates.erase(it);
+        released++;
     }
 
     if (released) {
@@ -628,6 +939,7 @@ FlexSectionItem *FlexSection::ensureItem()
     }
 
     m_sectionItem = new FlexSectionItem(this);
+    view->stats->current.sectionItemsCreated++;
 
     QQmlContext *parentContext = view->sectionDelegate->creationContext();
     if (!parentContext)
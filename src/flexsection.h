@@ -1,10 +1,28 @@
 #pragma once
 
 #include "flexview_p.h"
+#include "flexlayoutengine.h"
+#include "flexselection.h"
+#include "gapbuffer.h"
 
-class FlexRow;
-class ModelData;
 class FlexSectionItem;
+class FlexTileLayer;
+
+struct ModelData
+{
+    DelegateRef delegate;
+    qreal size;
+
+    ModelData()
+        : size(0)
+    {
+    }
+
+    ModelData(const ModelData &) = delete;
+    ModelData &operator=(const ModelData &) = delete;
+    ModelData(ModelData &&) = default;
+    ModelData &operator=(ModelData &&) = default;
+};
 
 class FlexSection : public QObject
 {
@@ -24,62 +42,119 @@ public:
     FlexViewPrivate * const view;
     const QString value;
 
-    int viewStart = -1;
     int count = 0;
+    // Index in view->sections, maintained by the view; -1 if not in the list
+    int position = -1;
 
     FlexSection(FlexViewPrivate *view, const QString &value);
     virtual ~FlexSection();
 
+    // The view index of the first row, from the sum of counts of previous sections. It's
+    // cached until any section changes. Sections outside of the list use setViewStart.
+    int viewStart() const
+    {
+        if (m_viewStartGeneration != view->sectionGeneration)
+            updateViewStart();
+        return m_viewStart;
+    }
+    void setViewStart(int start);
+
     int mapToView(int i) const
     {
-        Q_ASSERT(viewStart >= 0);
+        Q_ASSERT(viewStart() >= 0);
         Q_ASSERT(i < count);
         Q_ASSERT(i >= 0);
-        return viewStart + i;
+        return viewStart() + i;
     }
 
     int mapToSection(int i) const
     {
-        Q_ASSERT(viewStart >= 0);
-        if (i < viewStart || i >= viewStart + count)
+        int start = viewStart();
+        Q_ASSERT(start >= 0);
+        if (i < start || i >= start + count)
             return -1;
-        return i - viewStart;
+        return i - start;
     }
 
     bool setViewportWidth(qreal width);
     bool setSpacing(qreal horizontal, qreal vertical);
     bool setIdealHeight(qreal min, qreal ideal, qreal max);
+    // Lay out every item in a cell of ratio with FlexGridLayout, or justify rows by each
+    // item's ratio if it's 0
+    bool setCellRatio(qreal ratio);
 
     void insert(int i, int count);
     void remove(int i, int count);
     void change(int i, int count);
     void clear();
 
+    // Rows that move keep their delegate and size
+    ModelData takeData(int i);
+    void putData(int i, ModelData &&data);
+    void moveRows(int i, int count, FlexSection *other, int to);
+
     QQuickItem *currentItem();
     void setCurrentIndex(int index);
 
     bool layout();
+    bool isDirty() const { return dirty != 0; }
+    // Compact sections keep only count, height and ratio sum; sizes and rows are loaded
+    // again by the next layout. Sections start compact.
+    bool isCompact() const { return m_compact; }
+    void compact();
+    // Memory held for sizes and delegate refs, and for layout rows
+    qint64 itemDataBytes() const;
+    qint64 rowBytes() const;
+    void squeeze();
     void layoutDelegates(const QRectF &visibleArea, const QRectF &cacheArea);
     void releaseSectionDelegate();
 
     qreal estimatedHeight() const;
     qreal contentHeight() const { return m_contentHeight; }
+    // estimatedHeight as of the last updateHeight, which is what view->sectionHeights has
+    qreal height() const { return m_height; }
+    void updateHeight();
+    // Sum and number of sizes at the last layout
+    qreal ratioSum() const { return m_ratioSum; }
+    int ratioCount() const { return m_ratioCount; }
 
     int indexAt(const QPointF &pos);
     int rowAt(qreal y) const;
     int rowIndexAt(int row, qreal x, bool nearest = false);
     QRectF geometryOf(int i);
+    // Indices and geometry of items in rows intersecting the area, in contentItem coordinates
+    QVector<QPair<int, QRectF>> geometriesIn(qreal top, qreal bottom) const;
+    // First and last view index of each run of items intersecting area (in contentItem
+    // coordinates), appended to ranges
+    void indicesIn(const QRectF &area, QVector<QPair<int, int>> &ranges) const;
 
     int rowForIndex(int index) const;
-    int rowCount() const { return layoutRows.size(); }
+    // Positions relative to the top of the section item, which is estimated without one
+    qreal contentOffset();
+    qreal indexY(int index);
+    int indexAtY(qreal y);
+    int rowCount() const;
+
+    bool validate();
 
     FlexSectionItem *ensureItem();
+    bool hasItem() const { return m_sectionItem; }
     static FlexSectionItem *qmlAttachedProperties(QObject *obj);
 
 private:
     FlexSectionItem *m_sectionItem = nullptr;
-    QVector<FlexRow> layoutRows;
-    std::map<int, ModelData> m_data;
+    // Draws rows instead of delegates in tile mode; destroyed with the section item
+    QPointer<FlexTileLayer> m_tileLayer;
+    GapBuffer<qreal> m_sizes; // 0 until the size is loaded; empty when compact or uniform
+    // The ratio of every item when they're all the same, or 0. Rows inserted since the last
+    // layout are in m_unknownSizes until their size is loaded.
+    qreal m_uniformRatio = 0;
+    FlexSelection m_unknownSizes;
+    // Every item's size in the grid engine, which doesn't load them; 0 for justified rows
+    qreal m_cellRatio = 0;
+    // Rows of the last layout, by a grid engine when the sizes are uniform
+    QScopedPointer<FlexLayoutEngine> m_engine;
+    std::map<int, DelegateRef> m_delegates;
     DelegateRef m_currentItem;
     qreal viewportWidth = 0;
     qreal minHeight = 0;
@@ -87,20 +162,41 @@ private:
     qreal maxHeight = 0;
     qreal hSpacing = 0;
     qreal vSpacing = 0;
+    mutable int m_viewStart = -1;
+    mutable int m_viewStartGeneration = -1;
     qreal m_contentHeight = 0;
+    qreal m_height = 0;
+    qreal m_ratioSum = 0;
+    int m_ratioCount = 0;
     qreal m_lastSectionHeight = 0;
     int m_lastSectionCount = 0;
     int currentIndex = -1;
+    bool m_compact = true;
+    // Rows with delegates from the last layoutDelegates, from first up to end; end is -1
+    // when layout, the current index, or the section item changed since then
+    int m_windowFirst = 0;
+    int m_windowEnd = -1;
     DirtyFlags dirty = DirtyFlag::All;
 
     void adjustIndex(int from, int delta);
-    qreal badness(const FlexRow &row) const;
-    void layoutRow(const FlexRow &row, qreal y, bool create = true);
+    void updateViewStart() const;
+    qreal loadSize(int i) const;
+    qreal loadSizes();
+    qreal sizeAt(int i) const;
+    void setSize(int i, qreal size);
+    void materializeSizes();
+    FlexRow row(int r) const { return m_engine->row(r); }
+    qreal itemWidth(int i, const FlexRow &row) const { return m_engine->itemWidth(i, row); }
+    int firstRowEndingAfter(qreal y, bool inclusive) const { return m_engine ? m_engine->firstRowEndingAfter(y, inclusive) : 0; }
+    int rowsStartingBefore(qreal y, bool inclusive) const { return m_engine ? m_engine->rowsStartingBefore(y, inclusive) : 0; }
+    void layoutRow(const FlexRow &row, bool create = true);
+    void layoutTiles(int firstRow, int endRow);
+    void releaseRows(int first, int end);
 
     DelegateRef delegate(int index, bool create);
     void releaseDelegates(int first = 0, int last = -1);
 
-    ModelData &indexData(int index);
+    void adoptDelegate(DelegateRef &delegate);
 };
 QML_DECLARE_TYPEINFO(FlexSection, QML_HAS_ATTACHED_PROPERTIES)
 
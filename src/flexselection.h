@@ -0,0 +1,138 @@
+#pragma once
+
+#include <QPair>
+#include <QVector>
+#include <algorithm>
+
+// FlexSelection is a set of indices, kept as sorted ranges of first and last index that
+// neither overlap nor touch. Lookups are O(log n) in the number of ranges. Selecting or
+// deselecting replaces the ranges it covers in one step, so selecting everything costs the
+// same as one index, but adding or removing a range moves the ranges after it in the
+// vector. Inserting and removing indices shifts every range after them like model rows,
+// which is also O(ranges after the index).
+class FlexSelection
+{
+public:
+    typedef QPair<int, int> Range;
+
+    bool isEmpty() const { return m_ranges.isEmpty(); }
+    // Number of selected indices
+    int count() const { return m_count; }
+    const QVector<Range> &ranges() const { return m_ranges; }
+    qint64 bytes() const { return qint64(m_ranges.capacity()) * sizeof(Range); }
+
+    bool contains(int index) const
+    {
+        int i = lowerBound(index);
+        return i < m_ranges.size() && m_ranges[i].first <= index;
+    }
+
+    // Selected ranges within first..last, clipped to it
+    QVector<Range> rangesIn(int first, int last) const
+    {
+        QVector<Range> ranges;
+        for (int i = lowerBound(first); i < m_ranges.size() && m_ranges[i].first <= last; i++)
+            ranges.append({std::max(m_ranges[i].first, first), std::min(m_ranges[i].second, last)});
+        return ranges;
+    }
+
+    void clear()
+    {
+        m_ranges.clear();
+        m_count = 0;
+    }
+
+    void select(int first, int last)
+    {
+        if (first > last)
+            return;
+        // Ranges that overlap or touch first..last are merged into it
+        int i = lowerBound(first - 1);
+        int end = i;
+        for (; end < m_ranges.size() && m_ranges[end].first <= last + 1; end++) {
+            first = std::min(first, m_ranges[end].first);
+            last = std::max(last, m_ranges[end].second);
+            m_count -= size(m_ranges[end]);
+        }
+        replace(i, end, {Range(first, last)});
+    }
+
+    void deselect(int first, int last)
+    {
+        if (first > last)
+            return;
+        int i = lowerBound(first);
+        int end = i;
+        QVector<Range> keep;
+        for (; end < m_ranges.size() && m_ranges[end].first <= last; end++) {
+            const Range &range = m_ranges[end];
+            m_count -= size(range);
+            if (range.first < first)
+                keep.append({range.first, first - 1});
+            if (range.second > last)
+                keep.append({last + 1, range.second});
+        }
+        replace(i, end, keep);
+    }
+
+    // Shift for count indices inserted at index, which are not selected. A range that spans
+    // index is split around them.
+    void insert(int index, int count)
+    {
+        int i = lowerBound(index);
+        if (i < m_ranges.size() && m_ranges[i].first < index) {
+            Range before(m_ranges[i].first, index - 1);
+            m_ranges[i].first = index;
+            m_ranges.insert(i, before);
+            i++;
+        }
+        for (; i < m_ranges.size(); i++) {
+            m_ranges[i].first += count;
+            m_ranges[i].second += count;
+        }
+    }
+
+    // Drop count indices from index, and shift the ranges after them
+    void remove(int index, int count)
+    {
+        deselect(index, index + count - 1);
+        int i = lowerBound(index);
+        for (int j = i; j < m_ranges.size(); j++) {
+            m_ranges[j].first -= count;
+            m_ranges[j].second -= count;
+        }
+        // The ranges on either side of the removed indices may now touch
+        if (i > 0 && i < m_ranges.size() && m_ranges[i - 1].second + 1 == m_ranges[i].first) {
+            m_ranges[i - 1].second = m_ranges[i].second;
+            m_ranges.remove(i);
+        }
+    }
+
+private:
+    QVector<Range> m_ranges;
+    int m_count = 0;
+
+    static int size(const Range &range) { return range.second - range.first + 1; }
+
+    // The first range that ends at or after index
+    int lowerBound(int index) const
+    {
+        auto it = std::lower_bound(m_ranges.constBegin(), m_ranges.constEnd(), index,
+            [](const Range &range, int index) { return range.second < index; });
+        return std::distance(m_ranges.constBegin(), it);
+    }
+
+    // Replace ranges from first up to end with ranges, which are sorted and not counted yet
+    void replace(int first, int end, const QVector<Range> &ranges)
+    {
+        int common = std::min(end - first, ranges.size());
+        for (int i = 0; i < common; i++)
+            m_ranges[first + i] = ranges[i];
+        if (end - first > common)
+            m_ranges.remove(first + common, end - first - common);
+        for (int i = common; i < ranges.size(); i++)
+            m_ranges.insert(first + i, ranges[i]);
+        for (const Range &range : ranges)
+            m_count += size(range);
+    }
+};
@@ -0,0 +1,66 @@
+#include "flexstats.h"
+
+void FlexViewStats::Counters::add(const Counters &o)
+{
+    layoutNsecs += o.layoutNsecs;
+    viewportLayouts += o.viewportLayouts;
+    sectionLayoutNsecs += o.sectionLayoutNsecs;
+    maxSectionLayoutNsecs = std::max(maxSectionLayoutNsecs, o.maxSectionLayoutNsecs);
+    sectionsLaidOut += o.sectionsLaidOut;
+    gridLayouts += o.gridLayouts;
+    rowsBuilt += o.rowsBuilt;
+    candidateAdditions += o.candidateAdditions;
+    delegatesCreated += o.delegatesCreated;
+    delegatesReleased += o.delegatesReleased;
+    delegatesReused += o.delegatesReused;
+    sectionItemsCreated += o.sectionItemsCreated;
+    sectionsCompacted += o.sectionsCompacted;
+    pendingChanges += o.pendingChanges;
+    dataCalls += o.dataCalls;
+}
+
+// Times are reported in milliseconds for QML
+QVariantMap FlexViewStats::Counters::toMap() const
+{
+    return QVariantMap{
+        {"layoutTime", layoutNsecs / 1e6},
+        {"viewportLayouts", viewportLayouts},
+        {"sectionLayoutTime", sectionLayoutNsecs / 1e6},
+        {"maxSectionLayoutTime", maxSectionLayoutNsecs / 1e6},
+        {"sectionsLaidOut", sectionsLaidOut},
+        {"gridLayouts", gridLayouts},
+        {"rowsBuilt", rowsBuilt},
+        {"candidateAdditions", candidateAdditions},
+        {"delegatesCreated", delegatesCreated},
+        {"delegatesReleased", delegatesReleased},
+        {"delegatesReused", delegatesReused},
+        {"sectionItemsCreated", sectionItemsCreated},
+        {"sectionsCompacted", sectionsCompacted},
+        {"pendingChanges", pendingChanges},
+        {"dataCalls", dataCalls},
+    };
+}
+
+FlexViewStats::FlexViewStats(QObject *parent)
+    : QObject(parent)
+{
+}
+
+void FlexViewStats::endFrame(qint64 layoutNsecs)
+{
+    current.layoutNsecs += layoutNsecs;
+    m_frame = current;
+    m_total.add(current);
+    m_frameCount++;
+    current = Counters();
+    emit updated();
+}
+
+void FlexViewStats::reset()
+{
+    current = Counters();
+    m_frame = Counters();
+    m_total = Counters();
+    m_frameCount = 0;
+    emit updated();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QObject>
+#include <QVariantMap>
+#include <algorithm>
+
+// FlexViewStats collects cheap counters from the layout and delegate paths. Counters
+// accumulate into 'current' until the end of each layout pass, when they are published
+// as the last frame and added to the cumulative totals.
+class FlexViewStats : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(QVariantMap frame READ frame NOTIFY updated)
+    Q_PROPERTY(QVariantMap total READ total NOTIFY updated)
+    Q_PROPERTY(int frameCount READ frameCount NOTIFY updated)
+    Q_PROPERTY(int liveDelegates READ liveDelegates NOTIFY updated)
+
+public:
+    struct Counters
+    {
+        qint64 layoutNsecs = 0;
+        int viewportLayouts = 0;
+        qint64 sectionLayoutNsecs = 0;
+        qint64 maxSectionLayoutNsecs = 0;
+        int sectionsLaidOut = 0;
+        int gridLayouts = 0;
+        int rowsBuilt = 0;
+        qint64 candidateAdditions = 0;
+        int delegatesCreated = 0;
+        int delegatesReleased = 0;
+        int delegatesReused = 0;
+        int sectionItemsCreated = 0;
+        int sectionsCompacted = 0;
+        int pendingChanges = 0;
+        qint64 dataCalls = 0;
+
+        void add(const Counters &other);
+        QVariantMap toMap() const;
+    };
+
+    FlexViewStats(QObject *parent = nullptr);
+
+    // Counters for work done since the last completed frame
+    Counters current;
+    int liveDelegateCount = 0;
+
+    void sectionLaidOut(qint64 nsecs, int rows, qint64 additions)
+    {
+        current.sectionsLaidOut++;
+        current.sectionLayoutNsecs += nsecs;
+        current.maxSectionLayoutNsecs = std::max(current.maxSectionLayoutNsecs, nsecs);
+        current.rowsBuilt += rows;
+        current.candidateAdditions += additions;
+    }
+
+    void gridLaidOut(qint64 nsecs)
+    {
+        sectionLaidOut(nsecs, 0, 0);
+        current.gridLayouts++;
+    }
+
+    void endFrame(qint64 layoutNsecs);
+
+    const Counters &lastFrame() const { return m_frame; }
+    const Counters &totals() const { return m_total; }
+
+    QVariantMap frame() const { return m_frame.toMap(); }
+    QVariantMap total() const { return m_total.toMap(); }
+    int frameCount() const { return m_frameCount; }
+    int liveDelegates() const { return liveDelegateCount; }
+
+    Q_INVOKABLE void reset();
+
+signals:
+    void updated();
+
+private:
+    Counters m_frame;
+    Counters m_total;
+    int m_frameCount = 0;
+};
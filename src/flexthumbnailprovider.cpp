@@ -0,0 +1,301 @@
+#include "flexthumbnailprovider.h"
+#include "flextrace.h"
+#include <QAtomicPointer>
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QQmlEngine>
+#include <QUrl>
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(lcThumbnail, "crimson.flexview.thumbnail")
+
+class FlexThumbnailResponse : public QQuickImageResponse
+{
+public:
+    FlexThumbnailResponse(FlexThumbnailProvider *provider)
+        : m_provider(provider)
+    {
+    }
+
+    // The provider clears m_provider when the response completes, or when it's destroyed
+    virtual ~FlexThumbnailResponse()
+    {
+        cancel();
+    }
+
+    virtual QQuickTextureFactory *textureFactory() const override
+    {
+        return QQuickTextureFactory::textureFactoryForImage(m_image);
+    }
+
+    virtual QString errorString() const override
+    {
+        return m_error;
+    }
+
+    // m_provider is only changed with the provider's mutex held, and cancelResponse checks
+    // it again under the mutex
+    virtual void cancel() override
+    {
+        if (FlexThumbnailProvider *provider = m_provider.loadAcquire())
+            provider->cancelResponse(this);
+    }
+
+    // Called with the provider's mutex held, from any thread. finished is emitted from
+    // this object's thread, after the reader has connected to it.
+    void complete(const QImage &image, const QString &error = QString())
+    {
+        m_provider.storeRelease(nullptr);
+        m_image = image;
+        m_error = error;
+        QMetaObject::invokeMethod(this, [this] { emit finished(); }, Qt::QueuedConnection);
+    }
+
+private:
+    friend class FlexThumbnailProvider;
+
+    QAtomicPointer<FlexThumbnailProvider> m_provider;
+    QImage m_image;
+    QString m_error;
+};
+
+FlexThumbnailProvider *FlexThumbnailProvider::forEngine(QQmlEngine *engine)
+{
+    if (!engine)
+        return nullptr;
+    return dynamic_cast<FlexThumbnailProvider*>(engine->imageProvider(id()));
+}
+
+FlexThumbnailProvider::FlexThumbnailProvider()
+{
+    int megabytes = 128;
+    bool ok = false;
+    int value = qEnvironmentVariableIntValue("CRIMSON_FLEXTHUMB_CACHE_MB", &ok);
+    if (ok && value >= 0)
+        megabytes = std::min(value, 2047);
+    m_cache.setMaxCost(megabytes * 1024 * 1024);
+}
+
+FlexThumbnailProvider::~FlexThumbnailProvider()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_requests.clear();
+        m_prefetch.clear();
+    }
+    m_pool.clear();
+    m_pool.waitForDone();
+
+    QMutexLocker locker(&m_mutex);
+    for (const auto &waiters : qAsConst(m_decoding)) {
+        for (const Waiter &waiter : waiters)
+            waiter.done(QImage(), QStringLiteral("Image provider was destroyed"));
+    }
+    m_decoding.clear();
+}
+
+// Buckets are powers of two for the longer side, from 128 to 4096 pixels. Without a
+// requested size, the largest bucket is used.
+int FlexThumbnailProvider::bucketFor(const QSize &size)
+{
+    int longest = size.isValid() ? std::max(size.width(), size.height()) : 0;
+    if (longest <= 0)
+        return 4096;
+    int bucket = 128;
+    while (bucket < longest && bucket < 4096)
+        bucket *= 2;
+    return bucket;
+}
+
+QQuickImageResponse *FlexThumbnailProvider::requestImageResponse(const QString &id, const QSize &requestedSize)
+{
+    QString path = id.startsWith(QLatin1String("file:")) ? QUrl(id).toLocalFile() : id;
+    Key key{path, bucketFor(requestedSize)};
+    QString name = key.toString();
+    auto response = new FlexThumbnailResponse(this);
+
+    QMutexLocker locker(&m_mutex);
+    if (QImage *image = m_cache.object(name)) {
+        response->complete(*image);
+        return response;
+    } else if (m_failed.contains(name)) {
+        response->complete(QImage(), QStringLiteral("Cannot read image %1").arg(path));
+        return response;
+    }
+
+    wait(key, Waiter{response, [response](const QImage &image, const QString &error) {
+        response->complete(image, error);
+    }});
+    return response;
+}
+
+QImage FlexThumbnailProvider::thumbnail(const QString &path, const QSize &size, QObject *receiver, bool *failed)
+{
+    Key key{path, bucketFor(size)};
+    QMutexLocker locker(&m_mutex);
+    if (QImage *image = m_cache.object(key.toString()))
+        return *image;
+    if (m_failed.contains(key.toString())) {
+        if (failed)
+            *failed = true;
+        return QImage();
+    }
+
+    // The receiver can't be destroyed while it's waiting, because cancel() takes the mutex
+    const auto waiters = m_decoding.value(key.toString());
+    for (const Waiter &waiter : waiters) {
+        if (waiter.owner == receiver)
+            return QImage();
+    }
+    wait(key, Waiter{receiver, [receiver](const QImage &, const QString &) {
+        QMetaObject::invokeMethod(receiver, "thumbnailsReady", Qt::QueuedConnection);
+    }});
+    return QImage();
+}
+
+void FlexThumbnailProvider::cancel(QObject *receiver)
+{
+    QMutexLocker locker(&m_mutex);
+    removeWaiters(receiver);
+}
+
+// Add a waiter for key, and start decoding it unless it already is. Called with the mutex
+// held.
+void FlexThumbnailProvider::wait(const Key &key, const Waiter &waiter)
+{
+    QString name = key.toString();
+    bool decoding = m_decoding.contains(name);
+    m_decoding[name].append(waiter);
+    if (!decoding) {
+        m_requests.append(key);
+        dispatch();
+    }
+}
+
+// A decode that already started continues for the cache, as do prefetches. Requests that
+// haven't started are dropped when their last waiter goes, so a fast flick doesn't leave
+// stale decodes queued ahead of the visible ones. Called with the mutex held.
+void FlexThumbnailProvider::removeWaiters(const void *owner)
+{
+    for (auto it = m_decoding.begin(); it != m_decoding.end(); ) {
+        QVector<Waiter> &waiters = it.value();
+        auto end = std::remove_if(waiters.begin(), waiters.end(),
+            [owner](const Waiter &waiter) { return waiter.owner == owner; });
+        bool removed = end != waiters.end();
+        waiters.erase(end, waiters.end());
+        if (removed && waiters.isEmpty()) {
+            const QString &name = it.key();
+            auto queued = std::find_if(m_requests.begin(), m_requests.end(),
+                [&name](const Key &key) { return key.toString() == name; });
+            if (queued != m_requests.end()) {
+                m_requests.erase(queued);
+                it = m_decoding.erase(it);
+                continue;
+            }
+        }
+        ++it;
+    }
+}
+
+void FlexThumbnailProvider::prefetch(const QVector<QPair<QString, QSize>> &items)
+{
+    QMutexLocker locker(&m_mutex);
+    m_prefetch.clear();
+    for (const auto &item : items) {
+        Key key{item.first, bucketFor(item.second)};
+        QString name = key.toString();
+        if (!m_cache.contains(name) && !m_decoding.contains(name) && !m_failed.contains(name))
+            m_prefetch.append(key);
+    }
+    dispatch();
+}
+
+void FlexThumbnailProvider::trim(bool keepCache)
+{
+    QMutexLocker locker(&m_mutex);
+    m_prefetch.clear();
+    if (!keepCache) {
+        qCDebug(lcThumbnail) << "dropping" << m_cache.size() << "thumbnails in" << m_cache.totalCost() << "bytes";
+        m_cache.clear();
+        m_failed.clear();
+    }
+}
+
+qint64 FlexThumbnailProvider::cacheBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_cache.totalCost();
+}
+
+// Start decodes while there are free threads, for requests from delegates before
+// prefetches. Called with the mutex held.
+void FlexThumbnailProvider::dispatch()
+{
+    while (!m_stopping && m_running < m_pool.maxThreadCount()) {
+        Key key;
+        if (!m_requests.isEmpty()) {
+            key = m_requests.takeFirst();
+        } else if (!m_prefetch.isEmpty()) {
+            key = m_prefetch.takeFirst();
+            QString name = key.toString();
+            if (m_cache.contains(name) || m_decoding.contains(name) || m_failed.contains(name))
+                continue;
+            m_decoding.insert(name, {});
+        } else {
+            break;
+        }
+
+        m_running++;
+        m_pool.start(QRunnable::create([this, key] {
+            finishDecode(key, decode(key.path, key.bucket));
+        }));
+    }
+}
+
+void FlexThumbnailProvider::finishDecode(const Key &key, const QImage &image)
+{
+    QMutexLocker locker(&m_mutex);
+    m_running--;
+    QString name = key.toString();
+    // Thumbnails are at most 4096px on the longer side, so the cost fits
+    if (!image.isNull())
+        m_cache.insert(name, new QImage(image), int(image.sizeInBytes()));
+    else
+        m_failed.insert(name);
+
+    QString error = image.isNull() ? QStringLiteral("Cannot read image %1").arg(key.path) : QString();
+    for (const Waiter &waiter : m_decoding.take(name))
+        waiter.done(image, error);
+    dispatch();
+}
+
+// Called from the response's thread, without the mutex held
+void FlexThumbnailProvider::cancelResponse(FlexThumbnailResponse *response)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!response->m_provider.loadAcquire())
+        return;
+    response->m_provider.storeRelease(nullptr);
+    removeWaiters(response);
+}
+
+// Runs on a pool thread. The reader scales while decoding where the format supports it,
+// like JPEG, which is much faster than decoding at full size and scaling after.
+QImage FlexThumbnailProvider::decode(const QString &path, int bucket)
+{
+    FLEX_TRACE_SCOPE("FlexThumbnailProvider::decode");
+    QImageReader reader(path);
+    reader.setAutoTransform(true);
+    QSize size = reader.size();
+    int longest = std::max(size.width(), size.height());
+    if (size.isValid() && longest > bucket) {
+        QSizeF scaled = QSizeF(size) * (qreal(bucket) / longest);
+        reader.setScaledSize(scaled.toSize().expandedTo(QSize(1, 1)));
+    }
+
+    QImage image = reader.read();
+    if (image.isNull())
+        qCDebug(lcThumbnail) << "cannot read" << path << reader.errorString();
+    return image;
+}
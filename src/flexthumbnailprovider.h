@@ -0,0 +1,95 @@
+#pragma once
+
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QSet>
+#include <QQuickImageProvider>
+#include <QThreadPool>
+#include <QVector>
+#include <QLoggingCategory>
+#include <functional>
+
+class FlexThumbnailResponse;
+
+// FlexThumbnailProvider decodes local images at the size they're displayed, for delegates
+// with a source of "image://flexthumb/" + path and a sourceSize of their own size. Sizes
+// are rounded up to a few buckets by their longer side, so small changes in row height
+// reuse the same thumbnail, and decoding scales while reading where the format allows.
+//
+// Items that draw thumbnails themselves, like FlexView's tile layers, use thumbnail() and
+// are told when pending thumbnails are ready.
+//
+// Thumbnails are kept in an LRU cache of at most cacheBudget bytes, from the
+// CRIMSON_FLEXTHUMB_CACHE_MB environment variable or 128MB. FlexView queues thumbnails
+// for rows past the cache area, in the direction of scrolling, with prefetch(), which are
+// decoded after any that delegates requested. Requests whose last waiter is cancelled
+// before they start are dropped.
+//
+// Requests arrive on the image reader thread and decodes finish on pool threads, so all
+// state is guarded by one mutex.
+class FlexThumbnailProvider : public QQuickAsyncImageProvider
+{
+public:
+    static const char *id() { return "flexthumb"; }
+    static FlexThumbnailProvider *forEngine(QQmlEngine *engine);
+
+    FlexThumbnailProvider();
+    virtual ~FlexThumbnailProvider();
+
+    virtual QQuickImageResponse *requestImageResponse(const QString &id, const QSize &requestedSize) override;
+
+    // Replace queued prefetches with these paths and display sizes, in order
+    void prefetch(const QVector<QPair<QString, QSize>> &items);
+    // The cached thumbnail, or a null image after queueing it; thumbnailsReady() is then
+    // invoked on receiver when it's decoded, until cancel(receiver). If the image couldn't
+    // be decoded before, failed is set and nothing is queued.
+    QImage thumbnail(const QString &path, const QSize &size, QObject *receiver, bool *failed = nullptr);
+    void cancel(QObject *receiver);
+    // Drop queued prefetches and, unless keepCache, every cached thumbnail and failure
+    void trim(bool keepCache);
+
+    qint64 cacheBudget() const { return m_cache.maxCost(); }
+    qint64 cacheBytes() const;
+
+    static int bucketFor(const QSize &size);
+
+private:
+    friend class FlexThumbnailResponse;
+
+    // Called with the mutex held when a decode finishes
+    struct Waiter
+    {
+        const void *owner;
+        std::function<void(const QImage &image, const QString &error)> done;
+    };
+
+    struct Key
+    {
+        QString path;
+        int bucket = 0;
+        QString toString() const { return QString::number(bucket) + QLatin1Char(':') + path; }
+    };
+
+    mutable QMutex m_mutex;
+    QThreadPool m_pool;
+    QCache<QString, QImage> m_cache;
+    // Keys that failed to decode, which aren't decoded again until trim()
+    QSet<QString> m_failed;
+    // Waiters for each key that is being decoded
+    QHash<QString, QVector<Waiter>> m_decoding;
+    QVector<Key> m_requests;
+    QVector<Key> m_prefetch;
+    int m_running = 0;
+    bool m_stopping = false;
+
+    void dispatch();
+    void finishDecode(const Key &key, const QImage &image);
+    void wait(const Key &key, const Waiter &waiter);
+    void cancelResponse(FlexThumbnailResponse *response);
+    void removeWaiters(const void *owner);
+    static QImage decode(const QString &path, int bucket);
+};
+
+Q_DECLARE_LOGGING_CATEGORY(lcThumbnail)
@@ -0,0 +1,134 @@
+#include "flextilelayer.h"
+#include "flexsection.h"
+#include "flexthumbnailprovider.h"
+#include "flextrace.h"
+#include <QQmlEngine>
+#include <QQuickWindow>
+#include <QSGImageNode>
+
+// Owns the textures of a tile layer, which are destroyed with it on the render thread.
+// Textures are shared by tiles with the same thumbnail and kept while any tile uses one.
+class FlexTileNode : public QSGNode
+{
+public:
+    virtual ~FlexTileNode()
+    {
+        qDeleteAll(textures);
+    }
+
+    // By QImage::cacheKey()
+    QHash<qint64, QSGTexture*> textures;
+};
+
+FlexTileLayer::FlexTileLayer(FlexSection *section, QQuickItem *parent)
+    : QQuickItem(parent)
+    , m_section(section)
+{
+    setFlag(QQuickItem::ItemHasContents);
+    setAcceptedMouseButtons(Qt::LeftButton);
+    m_provider = FlexThumbnailProvider::forEngine(qmlEngine(section->view->q));
+    if (!m_provider)
+        qCWarning(lcDelegate) << "FlexView tile mode needs the" << FlexThumbnailProvider::id() << "image provider";
+}
+
+FlexTileLayer::~FlexTileLayer()
+{
+    if (m_provider)
+        m_provider->cancel(this);
+}
+
+void FlexTileLayer::setTiles(const QVector<Tile> &tiles)
+{
+    m_tiles = tiles;
+    m_images = QVector<QImage>(tiles.size());
+    m_failed = QVector<bool>(tiles.size());
+    m_tilesChanged = true;
+    loadImages();
+    update();
+}
+
+void FlexTileLayer::thumbnailsReady()
+{
+    loadImages();
+}
+
+// Thumbnails are requested at the size tiles are drawn in device pixels
+void FlexTileLayer::loadImages()
+{
+    if (!m_provider || !window())
+        return;
+
+    FLEX_TRACE_SCOPE("FlexTileLayer::loadImages");
+    qreal dpr = window()->effectiveDevicePixelRatio();
+    bool loaded = false;
+    for (int i = 0; i < m_tiles.size(); i++) {
+        if (!m_images[i].isNull() || m_failed[i] || m_tiles[i].path.isEmpty())
+            continue;
+        bool failed = false;
+        m_images[i] = m_provider->thumbnail(m_tiles[i].path, (m_tiles[i].rect.size() * dpr).toSize(), this, &failed);
+        m_failed[i] = failed;
+        loaded |= !m_images[i].isNull();
+    }
+
+    if (loaded) {
+        m_tilesChanged = true;
+        update();
+    }
+}
+
+// Runs on the render thread while the GUI thread is blocked. Tiles are rebuilt only when
+// they changed; scrolling moves the section item, which doesn't change this node.
+// Thumbnails that fit in the texture atlas share a texture, so the tiles are batched.
+QSGNode *FlexTileLayer::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *)
+{
+    auto node = static_cast<FlexTileNode*>(oldNode);
+    if (!node)
+        node = new FlexTileNode;
+    if (!m_tilesChanged)
+        return node;
+    m_tilesChanged = false;
+
+    FLEX_TRACE_SCOPE("FlexTileLayer::updatePaintNode");
+    while (QSGNode *child = node->firstChild())
+        delete child;
+
+    QHash<qint64, QSGTexture*> textures;
+    for (int i = 0; i < m_tiles.size(); i++) {
+        const QImage &image = m_images[i];
+        if (image.isNull())
+            continue;
+
+        QSGTexture *&texture = textures[image.cacheKey()];
+        if (!texture) {
+            texture = node->textures.take(image.cacheKey());
+            if (!texture)
+                texture = window()->createTextureFromImage(image, QQuickWindow::TextureCanUseAtlas);
+        }
+
+        QSGImageNode *tile = window()->createImageNode();
+        tile->setTexture(texture);
+        tile->setOwnsTexture(false);
+        tile->setFiltering(QSGTexture::Linear);
+        tile->setRect(m_tiles[i].rect);
+        node->appendChildNode(tile);
+    }
+
+    qDeleteAll(node->textures);
+    node->textures.swap(textures);
+    return node;
+}
+
+void FlexTileLayer::mousePressEvent(QMouseEvent *event)
+{
+    m_pressedIndex = m_section ? m_section->indexAt(event->localPos()) : -1;
+    if (m_pressedIndex < 0)
+        event->ignore();
+}
+
+void FlexTileLayer::mouseReleaseEvent(QMouseEvent *event)
+{
+    int index = m_section ? m_section->indexAt(event->localPos()) : -1;
+    if (index >= 0 && index == m_pressedIndex)
+        emit m_section->view->q->tileClicked(m_section->mapToView(index));
+    m_pressedIndex = -1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QImage>
+#include <QPointer>
+#include <QQuickItem>
+#include <QVector>
+
+class FlexSection;
+class FlexThumbnailProvider;
+
+// FlexTileLayer draws a section's rows as image tiles, for FlexView's tile mode. It fills
+// the section's contentItem and has one scene graph node for all tiles, with textures
+// from thumbnails in the flexthumb provider, instead of a delegate for each item. Clicks
+// on a tile are reported with FlexView::tileClicked.
+class FlexTileLayer : public QQuickItem
+{
+    Q_OBJECT
+
+public:
+    struct Tile
+    {
+        int index;
+        QRectF rect;
+        QString path;
+    };
+
+    FlexTileLayer(FlexSection *section, QQuickItem *parent);
+    virtual ~FlexTileLayer();
+
+    void setTiles(const QVector<Tile> &tiles);
+
+    Q_INVOKABLE void thumbnailsReady();
+
+protected:
+    virtual QSGNode *updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *data) override;
+    virtual void mousePressEvent(QMouseEvent *event) override;
+    virtual void mouseReleaseEvent(QMouseEvent *event) override;
+
+private:
+    QPointer<FlexSection> m_section;
+    FlexThumbnailProvider *m_provider = nullptr;
+    QVector<Tile> m_tiles;
+    // Thumbnail for each tile, or null until it's decoded
+    QVector<QImage> m_images;
+    // Tiles whose thumbnail can't be decoded, which aren't requested again
+    QVector<bool> m_failed;
+    bool m_tilesChanged = false;
+    int m_pressedIndex = -1;
+
+    void loadImages();
+};
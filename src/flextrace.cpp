@@ -0,0 +1,148 @@
+#include "flextrace.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(lcTrace, "crimson.flexview.trace")
+
+bool FlexTrace::s_enabled = false;
+
+struct FlexTraceState
+{
+    QMutex mutex;
+    QFile file;
+    QByteArray buffer;
+    QElapsedTimer clock;
+    qint64 pid = 0;
+
+    ~FlexTraceState()
+    {
+        FlexTrace::s_enabled = false;
+        if (file.isOpen()) {
+            file.write(buffer);
+            file.write("{}]\n");
+        }
+    }
+
+    void write(const QByteArray &event)
+    {
+        buffer.append(event);
+        if (buffer.size() > 64 * 1024) {
+            file.write(buffer);
+            buffer.clear();
+        }
+    }
+};
+
+Q_GLOBAL_STATIC(FlexTraceState, traceState)
+
+namespace {
+
+// Enable tracing from the environment when the plugin is loaded
+struct TraceEnvironment
+{
+    TraceEnvironment()
+    {
+        QString fileName = qEnvironmentVariable("CRIMSON_FLEXVIEW_TRACE");
+        if (!fileName.isEmpty())
+            FlexTrace::start(fileName);
+    }
+} traceEnvironment;
+
+}
+
+bool FlexTrace::start(const QString &fileName)
+{
+    FlexTraceState *state = traceState();
+    QMutexLocker lock(&state->mutex);
+    if (state->file.isOpen())
+        return false;
+
+    state->file.setFileName(fileName);
+    if (!state->file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(lcTrace) << "Cannot open trace file" << fileName << state->file.errorString();
+        return false;
+    }
+
+    state->pid = QCoreApplication::applicationPid();
+    state->clock.start();
+    state->write("[\n");
+    s_enabled = true;
+    qCInfo(lcTrace) << "Writing trace events to" << fileName;
+    return true;
+}
+
+void FlexTrace::stop()
+{
+    FlexTraceState *state = traceState();
+    QMutexLocker lock(&state->mutex);
+    if (!state->file.isOpen())
+        return;
+
+    s_enabled = false;
+    state->file.write(state->buffer);
+    state->file.write("{}]\n");
+    state->buffer.clear();
+    state->file.close();
+}
+
+void FlexTrace::flush()
+{
+    FlexTraceState *state = traceState();
+    QMutexLocker lock(&state->mutex);
+    if (!state->file.isOpen())
+        return;
+    state->file.write(state->buffer);
+    state->buffer.clear();
+    state->file.flush();
+}
+
+qint64 FlexTrace::timestamp()
+{
+    FlexTraceState *state = traceState();
+    return state ? state->clock.nsecsElapsed() : 0;
+}
+
+void FlexTrace::complete(const char *name, qint64 start, const QByteArray &args)
+{
+    FlexTraceState *state = traceState();
+    if (!state)
+        return;
+    qint64 end = state->clock.nsecsElapsed();
+
+    QByteArray event;
+    event.reserve(128 + args.size());
+    event.append("{\"name\":\"").append(name)
+        .append("\",\"cat\":\"flexview\",\"ph\":\"X\",\"ts\":").append(QByteArray::number(start / 1000.0, 'f', 3))
+        .append(",\"dur\":").append(QByteArray::number((end - start) / 1000.0, 'f', 3))
+        .append(",\"pid\":").append(QByteArray::number(state->pid))
+        .append(",\"tid\":").append(QByteArray::number(qulonglong(reinterpret_cast<quintptr>(QThread::currentThreadId()))));
+    if (!args.isEmpty())
+        event.append(",\"args\":{").append(args).append('}');
+    event.append("},\n");
+
+    QMutexLocker lock(&state->mutex);
+    if (s_enabled)
+        state->write(event);
+}
+
+void FlexTrace::counter(const char *name, qint64 value)
+{
+    FlexTraceState *state = traceState();
+    if (!state)
+        return;
+
+    QByteArray event;
+    event.reserve(128);
+    event.append("{\"name\":\"").append(name)
+        .append("\",\"cat\":\"flexview\",\"ph\":\"C\",\"ts\":").append(QByteArray::number(state->clock.nsecsElapsed() / 1000.0, 'f', 3))
+        .append(",\"pid\":").append(QByteArray::number(state->pid))
+        .append(",\"args\":{\"value\":").append(QByteArray::number(value)).append("}},\n");
+
+    QMutexLocker lock(&state->mutex);
+    if (s_enabled)
+        state->write(event);
+}
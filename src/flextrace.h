@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QtGlobal>
+
+// FlexTrace writes Chrome/Perfetto-compatible JSON trace events. It is off unless the
+// CRIMSON_FLEXVIEW_TRACE environment variable names an output file, or start() is called.
+// The output is a bare JSON array, which both viewers accept without the closing bracket,
+// so a trace is usable even if the process doesn't exit cleanly.
+//
+// Spans are written as complete ("X") events when their scope ends, so nested spans
+// appear in end order; the viewers sort by timestamp.
+class FlexTrace
+{
+public:
+    static bool isEnabled() { return s_enabled; }
+
+    static bool start(const QString &fileName);
+    static void stop();
+    static void flush();
+
+    static qint64 timestamp();
+    static void complete(const char *name, qint64 start, const QByteArray &args);
+    static void counter(const char *name, qint64 value);
+
+private:
+    friend struct FlexTraceState;
+    static bool s_enabled;
+};
+
+class FlexTraceScope
+{
+public:
+    explicit FlexTraceScope(const char *name)
+        : m_name(FlexTrace::isEnabled() ? name : nullptr)
+    {
+        if (m_name)
+            m_start = FlexTrace::timestamp();
+    }
+
+    ~FlexTraceScope()
+    {
+        if (m_name)
+            FlexTrace::complete(m_name, m_start, m_args);
+    }
+
+    FlexTraceScope(const FlexTraceScope &) = delete;
+    FlexTraceScope &operator=(const FlexTraceScope &) = delete;
+
+    bool isActive() const { return m_name; }
+
+    void arg(const char *name, qint64 value)
+    {
+        if (!m_name)
+            return;
+        if (!m_args.isEmpty())
+            m_args.append(',');
+        m_args.append('"').append(name).append("\":").append(QByteArray::number(value));
+    }
+
+private:
+    const char *m_name;
+    qint64 m_start = 0;
+    QByteArray m_args;
+};
+
+#define FLEX_TRACE_CONCAT2(a, b) a##b
+#define FLEX_TRACE_CONCAT(a, b) FLEX_TRACE_CONCAT2(a, b)
+#define FLEX_TRACE_SCOPE(name) FlexTraceScope FLEX_TRACE_CONCAT(flexTraceScope, __LINE__)(name)
+#define FLEX_TRACE_COUNTER(name, value) do { if (FlexTrace::isEnabled()) FlexTrace::counter(name, value); } while (0)
@@ -1,11 +1,23 @@
 #include "flexview_p.h"
 #include "flexsection.h"
+#include "flexlistmodel.h"
+#include "flexratioprovider.h"
+#include "flexthumbnailprovider.h"
+#include "flextrace.h"
 #include <QtQml>
 #include <QQmlComponent>
+#include <QQuickWindow>
+#include <QScopeGuard>
+#include <algorithm>
+#include <utility>
 
 Q_LOGGING_CATEGORY(lcView, "crimson.flexview")
 Q_LOGGING_CATEGORY(lcLayout, "crimson.flexview.layout")
 
+// Rough cost of a delegate or section item with its context and bindings. The real cost
+// depends on the components, so memory usage is only an estimate.
+static const qint64 delegateItemBytes = 4096;
+
 FlexView::FlexView(QQuickItem *parent)
     : QQuickFlickable(parent)
     , d(new FlexViewPrivate(this))
@@ -20,7 +32,7 @@ FlexView::~FlexView()
 void FlexView::componentComplete()
 {
     QQuickFlickable::componentComplete();
-    polish();
+    d->invalidateLayout();
 
     if (d->currentIndex >= 0) {
         int index = d->currentIndex;
@@ -44,17 +56,22 @@ void FlexView::setModel(QAbstractItemModel *model)
         disconnect(d->model, nullptr, d, nullptr);
 
     d->model = model;
+    d->listModel = qobject_cast<FlexListModel*>(model);
+    if (d->listModel)
+        connect(d->listModel, &FlexListModel::itemsQueued, d, &FlexViewPrivate::scheduleUpdate);
     if (d->model) {
         connect(d->model, &QAbstractItemModel::rowsInserted, d, &FlexViewPrivate::rowsInserted);
         connect(d->model, &QAbstractItemModel::rowsRemoved, d, &FlexViewPrivate::rowsRemoved);
         connect(d->model, &QAbstractItemModel::dataChanged, d, &FlexViewPrivate::dataChanged);
         connect(d->model, &QAbstractItemModel::rowsMoved, d, &FlexViewPrivate::rowsMoved);
+        connect(d->model, &QAbstractItemModel::layoutAboutToBeChanged, d, &FlexViewPrivate::layoutAboutToBeChanged);
         connect(d->model, &QAbstractItemModel::layoutChanged, d, &FlexViewPrivate::layoutChanged);
         connect(d->model, &QAbstractItemModel::modelReset, d, &FlexViewPrivate::modelReset);
     }
     d->items.setModel(model);
+    clearSelection();
 
-    polish();
+    d->invalidateLayout();
     qCDebug(lcView) << "setModel" << d->model;
     emit modelChanged();
 }
@@ -71,7 +88,7 @@ void FlexView::setDelegate(QQmlComponent *delegate)
 
     d->delegate = delegate;
     d->clear();
-    polish();
+    d->invalidateLayout();
 
     qCDebug(lcView) << "setDelegate" << delegate;
     emit delegateChanged();
@@ -89,7 +106,7 @@ void FlexView::setSection(QQmlComponent *delegate)
 
     d->sectionDelegate = delegate;
     d->clear();
-    polish();
+    d->invalidateLayout();
 
     qCDebug(lcView) << "setSection" << delegate;
     emit sectionChanged();
@@ -106,7 +123,7 @@ void FlexView::setSectionRole(const QString &role)
         return;
     d->sectionRole = role;
     d->clear();
-    polish();
+    d->invalidateLayout();
 
     qCDebug(lcView) << "setSectionRole" << role;
     emit sectionRoleChanged();
@@ -123,12 +140,46 @@ void FlexView::setSizeRole(const QString &role)
         return;
     d->sizeRole = role;
     d->clear();
-    polish();
+    d->invalidateLayout();
 
     qCDebug(lcView) << "setSizeRole" << role;
     emit sizeRoleChanged();
 }
 
+QString FlexView::ratioSourceRole() const
+{
+    return d->ratioSourceRole;
+}
+
+void FlexView::setRatioSourceRole(const QString &role)
+{
+    if (d->ratioSourceRole == role)
+        return;
+    d->ratioSourceRole = role;
+    d->clear();
+    d->invalidateLayout();
+
+    qCDebug(lcView) << "setRatioSourceRole" << role;
+    emit ratioSourceRoleChanged();
+}
+
+QString FlexView::tileRole() const
+{
+    return d->tileRole;
+}
+
+void FlexView::setTileRole(const QString &role)
+{
+    if (d->tileRole == role)
+        return;
+    d->tileRole = role;
+    d->clear();
+    d->invalidateLayout();
+
+    qCDebug(lcView) << "setTileRole" << role;
+    emit tileRoleChanged();
+}
+
 qreal FlexView::idealHeight() const
 {
     return d->idealHeight;
@@ -139,7 +190,7 @@ void FlexView::setIdealHeight(qreal height)
     if (d->idealHeight == height)
         return;
     d->idealHeight = height;
-    polish();
+    d->invalidateLayout();
     emit idealHeightChanged();
 }
 
@@ -153,7 +204,7 @@ void FlexView::setMinHeight(qreal height)
     if (d->minHeight == height)
         return;
     d->minHeight = height;
-    polish();
+    d->invalidateLayout();
     emit minHeightChanged();
 }
 
@@ -167,10 +218,42 @@ void FlexView::setMaxHeight(qreal height)
     if (d->maxHeight == height)
         return;
     d->maxHeight = height;
-    polish();
+    d->invalidateLayout();
     emit maxHeightChanged();
 }
 
+FlexView::LayoutMode FlexView::layoutMode() const
+{
+    return d->layoutMode;
+}
+
+void FlexView::setLayoutMode(LayoutMode mode)
+{
+    if (d->layoutMode == mode)
+        return;
+    d->layoutMode = mode;
+    d->invalidateLayout();
+    emit layoutModeChanged();
+}
+
+qreal FlexView::cellRatio() const
+{
+    return d->cellRatio;
+}
+
+void FlexView::setCellRatio(qreal ratio)
+{
+    if (ratio <= 0) {
+        qCWarning(lcView) << "cellRatio must be positive, not" << ratio;
+        return;
+    }
+    if (d->cellRatio == ratio)
+        return;
+    d->cellRatio = ratio;
+    d->invalidateLayout();
+    emit cellRatioChanged();
+}
+
 qreal FlexView::cacheBuffer() const
 {
     return d->cacheBuffer;
@@ -183,7 +266,21 @@ void FlexView::setCacheBuffer(qreal cacheBuffer)
         return;
     d->cacheBuffer = cacheBuffer;
     emit cacheBufferChanged();
-    polish();
+    d->invalidateLayout();
+}
+
+qreal FlexView::retainBuffer() const
+{
+    return d->retainBuffer;
+}
+
+void FlexView::setRetainBuffer(qreal retainBuffer)
+{
+    if (retainBuffer == d->retainBuffer)
+        return;
+    d->retainBuffer = retainBuffer;
+    emit retainBufferChanged();
+    d->invalidateLayout();
 }
 
 qreal FlexView::verticalSpacing() const
@@ -197,7 +294,7 @@ void FlexView::setVerticalSpacing(qreal spacing)
         return;
 
     d->vSpacing = spacing;
-    polish();
+    d->invalidateLayout();
     emit verticalSpacingChanged();
 }
 
@@ -212,7 +309,7 @@ void FlexView::setHorizontalSpacing(qreal spacing)
         return;
 
     d->hSpacing = spacing;
-    polish();
+    d->invalidateLayout();
     emit horizontalSpacingChanged();
 }
 
@@ -227,10 +324,128 @@ void FlexView::setSectionSpacing(qreal spacing)
         return;
 
     d->sectionSpacing = spacing;
-    polish();
+    d->invalidateLayout();
     emit sectionSpacingChanged();
 }
 
+int FlexView::updateLatency() const
+{
+    return d->updateLatency;
+}
+
+void FlexView::setUpdateLatency(int msecs)
+{
+    msecs = std::max(msecs, 0);
+    if (d->updateLatency == msecs)
+        return;
+
+    d->updateLatency = msecs;
+    if (d->updateTimer.isActive())
+        d->updateTimer.start(msecs);
+    emit updateLatencyChanged();
+}
+
+int FlexView::updateBudget() const
+{
+    return d->updateBudget;
+}
+
+void FlexView::setUpdateBudget(int msecs)
+{
+    msecs = std::max(msecs, 0);
+    if (d->updateBudget == msecs)
+        return;
+
+    d->updateBudget = msecs;
+    d->invalidateLayout();
+    emit updateBudgetChanged();
+}
+
+int FlexView::memoryBudget() const
+{
+    return d->memoryBudget;
+}
+
+void FlexView::setMemoryBudget(int kbytes)
+{
+    kbytes = std::max(kbytes, 0);
+    if (d->memoryBudget == kbytes)
+        return;
+
+    d->memoryBudget = kbytes;
+    d->invalidateLayout();
+    emit memoryBudgetChanged();
+}
+
+QVariantMap FlexView::memoryUsage() const
+{
+    return d->memoryUsage().toMap();
+}
+
+void FlexView::trimMemory(TrimLevel level)
+{
+    if (!isComponentComplete())
+        return;
+    if (d->inLayout) {
+        qCWarning(lcView) << "trimMemory cannot be called during layout";
+        return;
+    }
+    d->trimMemory(level);
+}
+
+FlexViewStats *FlexView::stats() const
+{
+    return d->stats;
+}
+
+FlexViewAttached *FlexView::qmlAttachedProperties(QObject *obj)
+{
+    QQmlContext *ctx = qmlContext(obj);
+    FlexView *view = ctx ? ctx->contextProperty("_flexview").value<FlexView*>() : nullptr;
+    return new FlexViewAttached(view, obj);
+}
+
+FlexViewAttached::FlexViewAttached(FlexView *view, QObject *parent)
+    : QObject(parent)
+    , m_view(view)
+{
+    if (!m_view)
+        return;
+    FlexViewPrivate *d = FlexViewPrivate::get(m_view);
+    d->attached.append(this);
+    m_selected = d->selection.contains(index());
+}
+
+FlexViewAttached::~FlexViewAttached()
+{
+    if (m_view)
+        FlexViewPrivate::get(m_view)->attached.removeOne(this);
+}
+
+int FlexViewAttached::index() const
+{
+    return DelegateManager::delegateIndex(parent());
+}
+
+void FlexViewAttached::setSelected(bool selected)
+{
+    int i = index();
+    if (!m_view || i < 0 || selected == m_selected)
+        return;
+    if (selected)
+        m_view->select(i);
+    else
+        m_view->deselect(i);
+}
+
+void FlexViewAttached::updateSelected(bool selected)
+{
+    if (selected == m_selected)
+        return;
+    m_selected = selected;
+    emit selectedChanged();
+}
+
 int FlexView::currentIndex() const
 {
     return d->currentIndex;
@@ -282,11 +497,15 @@ void FlexView::setCurrentIndex(int index)
 
     // Can't allow layout to recurse, so if setCurrentIndex is called during layout it
     // will just schedule another one. That can lead to currentItem/currentSection being
-    // temporarily null.
-    if (!d->inLayout)
+    // temporarily null. Between sections that were laid out around the viewport, only
+    // their delegates need to be updated.
+    if (!d->inLayout) {
+        if (!d->isActive(oldSection) || !d->isActive(d->currentSection))
+            d->layoutDirty = true;
         d->layout();
-    else
-        polish();
+    } else {
+        d->invalidateLayout();
+    }
 
     emit currentIndexChanged();
     emit currentItemChanged();
@@ -294,61 +513,72 @@ void FlexView::setCurrentIndex(int index)
         emit currentSectionChanged();
 }
 
+// Moves lay out only the sections they land in, so with the viewport around the current
+// item, setCurrentIndex can update just the delegates of the sections near it
 bool FlexView::moveCurrentRow(int delta)
 {
     if (delta == 0 || !isComponentComplete())
         return false;
+    if (d->inLayout) {
+        qCWarning(lcView) << "moveCurrentRow cannot be called during layout";
+        return false;
+    }
 
-    d->layout();
+    FLEX_TRACE_SCOPE("FlexView::moveCurrentRow");
+    d->applyPendingChanges();
+    d->updateSectionProperties();
 
     FlexSection *section = d->currentSection;
     int sectionIndex = -1;
     int row = -1;
     qreal xTarget = d->moveRowTargetX;
+    bool laidOut = false;
 
     if (section) {
-        sectionIndex = d->sections.indexOf(section);
-        Q_ASSERT(sectionIndex >= 0);
+        sectionIndex = d->sectionIndexAt(d->currentIndex);
+        Q_ASSERT(d->sections.value(sectionIndex) == section);
+        laidOut = d->layoutSection(section);
         int i = section->mapToSection(d->currentIndex);
         Q_ASSERT(i >= 0);
         row = section->rowForIndex(i);
-        Q_ASSERT(row >= 0);
+        if (row < 0)
+            return false;
         if (xTarget < 0)
             xTarget = section->geometryOf(i).center().x();
     } else if (delta > 0 && !d->sections.isEmpty()) {
         sectionIndex = 0;
-        section = d->sections[0];
+        laidOut = d->layoutSection(d->sections[0]);
     } else {
         return false;
     }
-    row += delta;
 
-    for (;;) {
-        Q_ASSERT(section->rowCount() > 0);
-        if (row >= section->rowCount()) {
-            if (sectionIndex >= d->sections.size() - 1) {
-                row = section->rowCount() - 1;
-                break;
-            }
-            row -= section->rowCount();
-            sectionIndex++;
-            section = d->sections[sectionIndex];
-        } else if (row < 0) {
-            if (sectionIndex < 1) {
-                row = 0;
-                break;
-            }
-            sectionIndex--;
-            section = d->sections[sectionIndex];
-            row += section->rowCount();
-        } else {
-            break;
-        }
+    int i = d->indexAtRowOffset(sectionIndex, row, delta, xTarget, laidOut);
+    if (laidOut)
+        d->invalidateLayout();
+    if (i < 0 || i == d->currentIndex)
+        return false;
+    setCurrentIndex(i);
+    d->moveRowTargetX = xTarget;
+    return true;
+}
+
+bool FlexView::movePage(int delta)
+{
+    if (delta == 0 || !isComponentComplete())
+        return false;
+    if (d->inLayout) {
+        qCWarning(lcView) << "movePage cannot be called during layout";
+        return false;
     }
-    Q_ASSERT(row >= 0 && row < section->rowCount());
 
-    int i = section->mapToView(section->rowIndexAt(row, xTarget, true));
-    Q_ASSERT(i >= 0);
+    FLEX_TRACE_SCOPE("FlexView::movePage");
+    QRectF geometry = d->currentIndex >= 0 ? d->geometryOf(d->currentIndex) : QRectF();
+    qreal xTarget = d->moveRowTargetX;
+    if (xTarget < 0)
+        xTarget = geometry.isNull() ? 0 : geometry.center().x();
+    qreal y = geometry.isNull() ? contentY() : geometry.center().y();
+
+    int i = d->indexNearest(QPointF(xTarget, y + delta * height()));
     if (i < 0 || i == d->currentIndex)
         return false;
     setCurrentIndex(i);
@@ -356,8 +586,168 @@ bool FlexView::moveCurrentRow(int delta)
     return true;
 }
 
+bool FlexView::moveToStart()
+{
+    if (!isComponentComplete())
+        return false;
+    d->applyPendingChanges();
+    if (d->count() < 1 || d->currentIndex == 0)
+        return false;
+    setCurrentIndex(0);
+    return true;
+}
+
+bool FlexView::moveToEnd()
+{
+    if (!isComponentComplete())
+        return false;
+    d->applyPendingChanges();
+    int last = d->count() - 1;
+    if (last < 0 || d->currentIndex == last)
+        return false;
+    // The last section must be loaded to become the current section
+    d->updateSectionProperties();
+    while (d->loadedCount() <= last && d->refill())
+        ;
+    setCurrentIndex(last);
+    return true;
+}
+
+void FlexView::positionViewAtIndex(int index, PositionMode mode)
+{
+    if (!isComponentComplete())
+        return;
+    if (d->inLayout) {
+        qCWarning(lcView) << "positionViewAtIndex cannot be called during layout";
+        return;
+    }
+    d->positionViewAtIndex(index, mode);
+}
+
+QVariantList FlexView::indicesInRect(const QRectF &rect)
+{
+    QVariantList ranges;
+    if (!isComponentComplete())
+        return ranges;
+    if (d->inLayout) {
+        qCWarning(lcView) << "indicesInRect cannot be called during layout";
+        return ranges;
+    }
+    for (const auto &range : d->indicesInRect(rect))
+        ranges.append(QVariant(QVariantList{range.first, range.second}));
+    return ranges;
+}
+
+QRectF FlexView::geometryOf(int index)
+{
+    if (!isComponentComplete())
+        return QRectF();
+    if (d->inLayout) {
+        qCWarning(lcView) << "geometryOf cannot be called during layout";
+        return QRectF();
+    }
+    return d->geometryOf(index);
+}
+
+int FlexView::selectedCount() const
+{
+    return d->selection.count();
+}
+
+// During layout, changes were applied when it started, and applying them again from a
+// delegate binding would change sections under the layout
+bool FlexView::isSelected(int index) const
+{
+    if (!d->inLayout)
+        d->applyPendingChanges();
+    return d->selection.contains(index);
+}
+
+void FlexView::select(int first, int last)
+{
+    if (d->inLayout) {
+        qCWarning(lcView) << "select cannot be called during layout";
+        return;
+    }
+    d->applyPendingChanges();
+    if (last < 0)
+        last = first;
+    first = std::max(first, 0);
+    last = std::min(last, d->count() - 1);
+    int oldCount = d->selection.count();
+    d->selection.select(first, last);
+    if (d->selection.count() == oldCount)
+        return;
+
+    qCDebug(lcView) << "select" << first << "to" << last;
+    d->updateSelected(first, last);
+    emit selectionChanged();
+}
+
+void FlexView::deselect(int first, int last)
+{
+    if (d->inLayout) {
+        qCWarning(lcView) << "deselect cannot be called during layout";
+        return;
+    }
+    d->applyPendingChanges();
+    if (last < 0)
+        last = first;
+    int oldCount = d->selection.count();
+    d->selection.deselect(first, last);
+    if (d->selection.count() == oldCount)
+        return;
+
+    qCDebug(lcView) << "deselect" << first << "to" << last;
+    d->updateSelected(first, last);
+    emit selectionChanged();
+}
+
+void FlexView::selectAll()
+{
+    select(0, d->count() - 1);
+}
+
+void FlexView::clearSelection()
+{
+    if (d->selection.isEmpty())
+        return;
+
+    qCDebug(lcView) << "clear selection of" << d->selection.count();
+    d->selection.clear();
+    d->updateSelected(0, INT_MAX);
+    emit selectionChanged();
+}
+
+QVariantList FlexView::selectedRanges() const
+{
+    if (!d->inLayout)
+        d->applyPendingChanges();
+    QVariantList ranges;
+    for (const auto &range : d->selection.ranges())
+        ranges.append(QVariant(QVariantList{range.first, range.second}));
+    return ranges;
+}
+
+qreal FlexView::originY() const
+{
+    return d->contentOrigin;
+}
+
+qreal FlexView::minYExtent() const
+{
+    return topMargin() - d->contentOrigin;
+}
+
+qreal FlexView::maxYExtent() const
+{
+    qreal extent = height() - contentHeight() - bottomMargin() - d->contentOrigin;
+    return std::min(minYExtent(), extent);
+}
+
 void FlexView::updatePolish()
 {
+    FLEX_TRACE_SCOPE("FlexView::updatePolish");
     QQuickFlickable::updatePolish();
 
     if (d->idealHeight > 0 && d->minHeight < 1)
@@ -373,19 +763,27 @@ void FlexView::geometryChanged(const QRectF &newRect, const QRectF &oldRect)
     qCDebug(lcView) << "geometryChanged" << newRect << oldRect;
     QQuickFlickable::geometryChanged(newRect, oldRect);
     if (newRect.size() != oldRect.size())
-        polish();
+        d->invalidateLayout();
 }
 
 void FlexView::viewportMoved(Qt::Orientations orient)
 {
     QQuickFlickable::viewportMoved(orient);
+    // Anything but the view itself moving contentY ends positionViewAtIndex corrections
+    if (!d->inLayout)
+        d->positionIndex = -1;
     polish();
 }
 
 FlexViewPrivate::FlexViewPrivate(FlexView *q)
     : QObject(q)
     , q(q)
+    , stats(new FlexViewStats(this))
 {
+    items.setStats(stats);
+    items.setContextProperty("_flexview", QVariant::fromValue(q));
+    updateTimer.setSingleShot(true);
+    connect(&updateTimer, &QTimer::timeout, q, &QQuickItem::polish);
 }
 
 FlexViewPrivate::~FlexViewPrivate()
@@ -406,149 +804,812 @@ void FlexViewPrivate::clear()
 
     qCDebug(lcView) << "view cleared";
     pendingChanges.clear();
+    pendingData.clear();
     moveId = -1;
     items.clear();
-    for (FlexSection *section : sections)
+    for (FlexSection *section : sections) {
+        section->position = -1;
         section->deleteLater();
+    }
     sections.clear();
+    mergeCandidates.clear();
+    sectionCounts.clear();
+    sectionHeights.clear();
+    sectionIndexDirty = false;
+    sectionGeneration++;
+    ratioSum = 0;
+    ratioCount = 0;
     sectionRoleIdx = -1;
     sizeRoleIdx = -1;
+    ratioSourceRoleIdx = -1;
+    tileRoleIdx = -1;
+    if (ratioProvider)
+        ratioProvider->cancel();
     // currentIndex goes to a state as if it had been set when the section didn't exist
     currentIndex = -1;
     currentSection = nullptr;
     moveRowTargetX = -1;
+    layoutDirty = true;
+    activeSections.clear();
+    loadedSections.clear();
+    activeFirst = activeLast = -1;
+    positionIndex = -1;
+    anchorRow = QPersistentModelIndex();
+    // Keep contentY where it was relative to the start of content
+    if (contentOrigin != 0) {
+        qreal contentY = q->contentY() - contentOrigin;
+        setContentOrigin(0);
+        q->setContentY(contentY);
+    }
+    persistentRows.clear();
+    persistentCurrent = QPersistentModelIndex();
 }
 
 void FlexViewPrivate::rowsInserted(const QModelIndex &parent, int first, int last)
 {
     Q_UNUSED(parent);
     pendingChanges.insert(first, last-first+1);
-    q->polish();
+    shiftPendingData(first, last-first+1);
+    scheduleUpdate();
 }
 
 void FlexViewPrivate::rowsRemoved(const QModelIndex &parent, int first, int last)
 {
     Q_UNUSED(parent);
     pendingChanges.remove(first, last-first+1);
-    q->polish();
+    shiftPendingData(first, -(last-first+1));
+    scheduleUpdate();
 }
 
 void FlexViewPrivate::rowsMoved(const QModelIndex &parent, int start, int end, const QModelIndex &destination, int row)
 {
     Q_UNUSED(parent);
-    // XXX
-    qFatal("rowsMoved not implemented");
+    Q_UNUSED(destination);
+    int count = end - start + 1;
+    // QQmlChangeSet wants the destination after the rows have been removed
+    int to = row > start ? row - count : row;
+    pendingChanges.move(start, to, count, ++moveId);
+
+    // Data changes in the moved rows follow them
+    QVector<PendingData> moved;
+    for (const PendingData &data : qAsConst(pendingData)) {
+        int first = std::max(data.first, start);
+        int last = std::min(data.last, end);
+        if (first <= last)
+            moved.append({to + first - start, to + last - start, data.roles});
+    }
+    shiftPendingData(start, -count);
+    shiftPendingData(to, count);
+    pendingData.append(moved);
+    scheduleUpdate();
+}
+
+// Shift pendingData for count rows inserted at index, or -count rows removed. Ranges that
+// span an insert grow to include it, which only notifies more delegates than necessary.
+void FlexViewPrivate::shiftPendingData(int index, int count)
+{
+    for (int i = 0; i < pendingData.size(); ) {
+        PendingData &data = pendingData[i];
+        if (count > 0) {
+            if (data.first >= index)
+                data.first += count;
+            if (data.last >= index)
+                data.last += count;
+        } else {
+            int end = index - count;
+            data.first = data.first >= end ? data.first + count : std::min(data.first, index);
+            data.last = data.last >= end ? data.last + count : std::min(data.last, index - 1);
+            if (data.first > data.last) {
+                pendingData.remove(i);
+                continue;
+            }
+        }
+        i++;
+    }
 }
 
 void FlexViewPrivate::dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles)
 {
     int count = bottomRight.row() - topLeft.row() + 1;
     pendingChanges.change(topLeft.row(), count);
-    q->polish();
+    scheduleUpdate();
 
-    for (int i = topLeft.row(); i <= bottomRight.row(); i++) {
-        items.dataChanged(i, roles);
-    }
+    // Delegates are notified by index, which only matches the model once inserts and
+    // removes are applied. Until then, the change waits in pendingData.
+    if (pendingChanges.removes().isEmpty() && pendingChanges.inserts().isEmpty())
+        items.dataChanged(topLeft.row(), bottomRight.row(), roles);
+    else
+        pendingData.append({topLeft.row(), bottomRight.row(), roles});
 }
 
-void FlexViewPrivate::layoutChanged()
+// Tell attached objects of delegates from first to last about their selection; each only
+// notifies if its own state changed
+void FlexViewPrivate::updateSelected(int first, int last)
 {
-    // XXX
-    modelReset();
+    for (FlexViewAttached *object : qAsConst(attached)) {
+        int index = object->index();
+        if (index >= first && index <= last)
+            object->updateSelected(selection.contains(index));
+    }
 }
 
-void FlexViewPrivate::modelReset()
+// Rebuild the selection after a layout change from the persistent indices of selected rows
+void FlexViewPrivate::restoreSelection(const QVector<QPersistentModelIndex> &selected)
 {
-    qCDebug(lcView) << "model reset";
-    clear();
-    q->polish();
-}
+    if (selected.isEmpty())
+        return;
 
-void FlexViewPrivate::layout()
-{
-    if (!q->isComponentComplete())
+    QVector<int> rows;
+    rows.reserve(selected.size());
+    for (const auto &index : selected) {
+        if (index.isValid())
+            rows.append(index.row());
+    }
+    std::sort(rows.begin(), rows.end());
+
+    FlexSelection restored;
+    for (int row : rows)
+        restored.select(row, row);
+    if (restored.ranges() == selection.ranges())
         return;
 
-    if (inLayout) {
-        qCWarning(lcLayout) << "FlexView cannot run layout recursively";
+    qCDebug(lcView) << "selection of" << selection.count() << "moved by layout change";
+    selection = restored;
+    updateSelected(0, INT_MAX);
+    emit q->selectionChanged();
+}
+
+// Layout changes (e.g. sorting a proxy model) can move any row anywhere. Every loaded row
+// is tracked with a persistent index, so sections where every row stayed in place are kept
+// as they are, and the others are rebuilt with the data and delegates of their rows.
+void FlexViewPrivate::layoutAboutToBeChanged()
+{
+    persistentRows.clear();
+    persistentCurrent = QPersistentModelIndex();
+    persistentSelection.clear();
+    if (!q->isComponentComplete() || !model)
         return;
-    }
-    QScopedValueRollback guard(inLayout, true);
 
     applyPendingChanges();
+    if (currentIndex >= 0)
+        persistentCurrent = model->index(currentIndex, 0);
+    // A selection of every row is still every row afterwards
+    if (!selection.isEmpty() && selection.count() < count()) {
+        persistentSelection.reserve(selection.count());
+        for (const auto &range : selection.ranges()) {
+            for (int i = range.first; i <= range.second; i++)
+                persistentSelection.append(model->index(i, 0));
+        }
+    }
+    if (sections.isEmpty())
+        return;
+
+    int loaded = loadedCount();
+    persistentRows.reserve(loaded);
+    for (int i = 0; i < loaded; i++)
+        persistentRows.append(model->index(i, 0));
+}
+
+void FlexViewPrivate::layoutChanged()
+{
+    if (!q->isComponentComplete())
+        return;
+
+    QVector<QPersistentModelIndex> rows;
+    rows.swap(persistentRows);
+    QPersistentModelIndex current = persistentCurrent;
+    persistentCurrent = QPersistentModelIndex();
+    QVector<QPersistentModelIndex> selected;
+    selected.swap(persistentSelection);
+
+    int loaded = loadedCount();
+    if (!pendingChanges.isEmpty() || rows.size() != loaded || loaded > count()) {
+        // No matching layoutAboutToBeChanged, or the rows changed in between
+        bool allSelected = !selection.isEmpty() && selection.count() == count();
+        modelReset();
+        if (allSelected)
+            q->selectAll();
+        else
+            restoreSelection(selected);
+        return;
+    }
+    restoreSelection(selected);
+
+    FLEX_TRACE_SCOPE("FlexViewPrivate::layoutChanged");
+    int oldCurrentIndex = currentIndex;
+    QPointer<FlexSection> oldCurrentSection(currentSection);
+
+    // Rows that leave the loaded range are dropped; they will be loaded again by refill
+    QVector<int> newRows(loaded);
+    for (int i = 0; i < loaded; i++) {
+        int row = rows[i].isValid() ? rows[i].row() : -1;
+        newRows[i] = row < loaded ? row : -1;
+    }
+    items.remap(newRows);
+
+    // Rows can move between any changed sections, so take all of their data before rebuilding
+    QList<FlexSection*> oldSections = sections;
+    QVector<int> oldStarts(oldSections.size());
+    QVector<bool> changed(oldSections.size());
+    std::map<int, ModelData> moved;
+    int rebuilt = 0;
+    for (int s = 0; s < oldSections.size(); s++) {
+        FlexSection *section = oldSections[s];
+        int start = oldStarts[s] = section->viewStart();
+        for (int i = start; i < start + section->count && !changed[s]; i++)
+            changed[s] = newRows[i] != i;
+        if (!changed[s])
+            continue;
+        rebuilt++;
+        for (int i = 0; i < section->count; i++) {
+            int row = newRows[start + i];
+            ModelData data = section->takeData(i);
+            if (row >= 0 && (data.delegate || data.size))
+                moved.emplace(row, std::move(data));
+        }
+    }
+
+    // Replace each run of changed sections with sections built from the model
+    for (int s = oldSections.size() - 1; s >= 0; s--) {
+        if (!changed[s])
+            continue;
+        int last = s;
+        while (s > 0 && changed[s - 1])
+            s--;
+
+        int changedFirst = oldStarts[s];
+        int changedEnd = last + 1 < oldSections.size() ? oldStarts[last + 1] : loaded;
+        for (int t = last; t >= s; t--) {
+            oldSections[t]->deleteLater();
+            removeSection(t);
+        }
+
+        int at = s;
+        for (const auto &run : sectionRuns(changedFirst, changedEnd - changedFirst)) {
+            FlexSection *newSection = new FlexSection(this, run.first);
+            newSection->insert(0, run.second);
+            auto it = moved.lower_bound(changedFirst);
+            while (it != moved.end() && it->first < changedFirst + run.second) {
+                newSection->putData(it->first - changedFirst, std::move(it->second));
+                it = moved.erase(it);
+            }
+            insertSection(at++, newSection);
+            changedFirst += run.second;
+        }
+    }
+    qCDebug(lcView) << "layout changed, rebuilt" << rebuilt << "of" << oldSections.size() << "sections";
+
+    mergeSections();
+    currentIndex = current.isValid() ? current.row() : -1;
+    updateCurrentSection(oldCurrentIndex, oldCurrentSection);
+    invalidateLayout();
+}
+
+void FlexViewPrivate::modelReset()
+{
+    qCDebug(lcView) << "model reset";
+    clear();
+    q->clearSelection();
+    invalidateLayout();
+}
+
+void FlexViewPrivate::invalidateLayout()
+{
+    layoutDirty = true;
+    q->polish();
+}
+
+// Request a polish for model changes. With an updateLatency, changes that arrive in quick
+// succession are collected by pendingChanges (which merges adjacent ranges) and applied
+// together, unless something else causes a layout first.
+void FlexViewPrivate::scheduleUpdate()
+{
+    if (draining)
+        return;
+    if (updateLatency <= 0)
+        q->polish();
+    else if (!updateTimer.isActive())
+        updateTimer.start(updateLatency);
+}
+
+void FlexViewPrivate::layout()
+{
+    if (!q->isComponentComplete())
+        return;
+
+    if (inLayout) {
+        qCWarning(lcLayout) << "FlexView cannot run layout recursively";
+        return;
+    }
+    QScopedValueRollback guard(inLayout, true);
+    FLEX_TRACE_SCOPE("FlexViewPrivate::layout");
+    QElapsedTimer frameTimer;
+    frameTimer.start();
+    auto statsGuard = qScopeGuard([&] { stats->endFrame(frameTimer.nsecsElapsed()); });
+
+    // Rows queued by workers since the last frame arrive as a single insert
+    if (listModel) {
+        QScopedValueRollback drainGuard(draining, true);
+        listModel->drain();
+    }
+    applyPendingChanges();
+    updateSectionProperties();
+
+    QRectF visibleArea(q->contentX(), q->contentY(), q->width(), q->height());
+    QRectF cacheArea(trimCache ? visibleArea : visibleArea.adjusted(0, -cacheBuffer, 0, cacheBuffer));
+    if (!layoutDirty && layoutViewport(visibleArea, cacheArea)) {
+        updateAnchor(visibleArea);
+        prefetchThumbnails(visibleArea, cacheArea);
+        return;
+    }
+
     if (lcLayout().isDebugEnabled())
         validateSections();
 
-    QRectF visibleArea(q->contentX(), q->contentY(), q->width(), q->height());
-    QRectF cacheArea(visibleArea.adjusted(0, -cacheBuffer, 0, cacheBuffer));
+    // Move the origin so the first visible row stays where it was, if heights above it
+    // changed since the last pass
+    if (positionIndex < 0) {
+        qreal delta = anchorDelta();
+        if (qAbs(delta) >= 0.5)
+            setContentOrigin(contentOrigin - delta);
+    }
+
     qreal viewportWidth = q->width(); // XXX contentWidth?
     qCDebug(lcLayout) << "layout area" << visibleArea << "viewportWidth" << viewportWidth << "current" << currentIndex;
 
-    qreal x = 0, y = 0;
-    int lastIndex = -1;
-    for (int s = 0; ; s++) {
-        if (s > 0)
-            y += sectionSpacing;
-
-        if (s >= sections.size()) {
-            if ((y > cacheArea.bottom() && lastIndex >= currentIndex) || !refill())
-                break;
+    // Load sections until they cover the cache area and the current index
+    while ((sectionY(sections.size()) <= cacheArea.bottom() || loadedCount() <= currentIndex) && refill())
+        ;
+
+    QList<QPointer<FlexSection>> previousSections;
+    previousSections.swap(activeSections);
+    activeFirst = activeLast = -1;
+    int deferred = 0;
+
+    // Sections above the cache area are positioned by their estimated heights and aren't
+    // visited, so nothing before the viewport is laid out. Over budget, changed sections
+    // that aren't visible keep their estimates and are left for later frames.
+    int first = sectionAtY(cacheArea.top());
+    qreal y = sectionY(first);
+    for (int s = first; s < sections.size() && y <= cacheArea.bottom(); s++) {
+        FlexSection *section = sections[s];
+        applySectionProperties(section);
+
+        bool overBudget = updateBudget > 0 && frameTimer.elapsed() >= updateBudget;
+        if (overBudget && section->isDirty() && section != currentSection
+            && !visibleArea.intersects(QRectF(0, y, viewportWidth, section->height()))) {
+            deferred++;
+            activeSections.append(section);
+            y += section->height() + sectionSpacing;
+            continue;
         }
 
-        FlexSection *section = sections[s];
-        section->setViewportWidth(viewportWidth);
-        section->setSpacing(hSpacing, vSpacing);
-        section->setIdealHeight(minHeight, idealHeight, maxHeight);
         section->layout();
+        if (!layoutSectionItem(section, y, visibleArea, cacheArea))
+            return;
 
-        qreal height = section->estimatedHeight();
-        Q_ASSERT(height > 0);
-        if (!cacheArea.intersects(QRectF(x, y, viewportWidth, height)) && section != currentSection) {
-            qCDebug(lcLayout) << "section" << s << "y" << y << "estimatedHeight" << height << "not visible";
+        activeSections.append(section);
+        if (activeFirst < 0) {
+            activeFirst = s;
+            activeTop = y;
+        }
+        activeLast = s;
+        activeBottom = y + section->height();
+        y += section->height() + sectionSpacing;
+    }
+
+    // The current section keeps its item and current delegate wherever it is
+    if (currentSection && currentSection->position >= 0 && !activeSections.contains(currentSection)) {
+        applySectionProperties(currentSection);
+        currentSection->layout();
+        if (!layoutSectionItem(currentSection, sectionY(currentSection->position), visibleArea, cacheArea))
+            return;
+        activeSections.append(currentSection);
+    }
+
+    for (const auto &section : previousSections) {
+        if (section && !activeSections.contains(section)) {
+            qCDebug(lcLayout) << "section" << section->position << "is no longer near the viewport";
             section->releaseSectionDelegate();
-            y += height;
+        }
+    }
+
+    // Sections above the anchor that were laid out in this pass can still move it. Moving
+    // the origin again keeps the viewport in place, and only the edges of the cache area
+    // need new delegates.
+    bool relayout = false;
+    if (positionIndex < 0 && activeFirst >= 0) {
+        qreal delta = anchorDelta();
+        if (qAbs(delta) >= 0.5) {
+            setContentOrigin(contentOrigin - delta);
+            activeTop -= delta;
+            activeBottom -= delta;
+            laidOutArea = visibleArea;
+            relayout = !layoutViewport(visibleArea, cacheArea);
+        }
+    }
+
+    updateContentHeight();
+    if (positionIndex >= 0)
+        correctPosition();
+    updateAnchor(visibleArea);
+    prefetchThumbnails(visibleArea, cacheArea);
+    if (retainBuffer >= 0)
+        compactSections(cacheArea, retainBuffer);
+    if (memoryBudget > 0)
+        enforceMemoryBudget(cacheArea);
+
+    if (deferred) {
+        qCDebug(lcLayout) << "deferred layout of" << deferred << "sections to the next frame";
+        updateTimer.start(0);
+    } else if (relayout) {
+        q->polish();
+    } else {
+        layoutDirty = false;
+        laidOutArea = visibleArea;
+    }
+}
+
+// Position the section's item at y, and lay out its delegates for the areas
+bool FlexViewPrivate::layoutSectionItem(FlexSection *section, qreal y, const QRectF &visibleArea, const QRectF &cacheArea)
+{
+    FlexSectionItem *sectionItem = section->ensureItem();
+    if (!sectionItem)
+        return false;
+    sectionItem->item()->setPosition(QPointF(0, y));
+    sectionItem->item()->setImplicitWidth(q->width());
+    sectionItem->item()->setImplicitHeight(section->contentHeight());
+
+    QRectF sectionVisibleArea = sectionItem->contentItem()->mapRectFromItem(q->contentItem(), visibleArea);
+    QRectF sectionCacheArea = sectionItem->contentItem()->mapRectFromItem(q->contentItem(), cacheArea);
+    section->layoutDelegates(sectionVisibleArea, sectionCacheArea);
+    return true;
+}
+
+void FlexViewPrivate::applySectionProperties(FlexSection *section)
+{
+    section->setViewportWidth(q->width());
+    section->setSpacing(hSpacing, vSpacing);
+    section->setIdealHeight(minHeight, idealHeight, maxHeight);
+    section->setCellRatio(layoutMode == FlexView::GridLayout ? cellRatio : 0);
+}
+
+// Every section's height depends on these, so a change re-estimates all of them
+void FlexViewPrivate::updateSectionProperties()
+{
+    QVector<qreal> properties{q->width(), minHeight, idealHeight, maxHeight, hSpacing, vSpacing, sectionSpacing,
+        layoutMode == FlexView::GridLayout ? cellRatio : 0};
+    if (properties == sectionProperties)
+        return;
+    qCDebug(lcLayout) << "section properties changed, estimating all section heights";
+    sectionProperties = properties;
+    sectionIndexDirty = true;
+    for (FlexSection *section : sections)
+        applySectionProperties(section);
+}
+
+// Place index in the viewport by mode. Sections are loaded up to index, but only its own
+// section is laid out; everything above is positioned by sectionHeights, and layout
+// corrects contentY as real heights replace the estimates.
+void FlexViewPrivate::positionViewAtIndex(int index, FlexView::PositionMode mode)
+{
+    applyPendingChanges();
+    if (index < 0 || index >= count())
+        return;
+
+    FLEX_TRACE_SCOPE("FlexViewPrivate::positionViewAtIndex");
+    updateSectionProperties();
+    while (loadedCount() <= index && refill())
+        ;
+    int s = sectionIndexAt(index);
+    if (s >= sections.size())
+        return;
+
+    qreal y = sectionY(s);
+    FlexSection *section = sections[s];
+    applySectionProperties(section);
+    section->layout();
+    FlexSectionItem *sectionItem = section->ensureItem();
+    if (!sectionItem)
+        return;
+    sectionItem->item()->setPosition(QPointF(0, y));
+    sectionItem->item()->setImplicitWidth(q->width());
+    sectionItem->item()->setImplicitHeight(section->contentHeight());
+
+    QRectF geometry = sectionItem->contentItem()->mapRectToItem(q->contentItem(), section->geometryOf(section->mapToSection(index)));
+    qCDebug(lcView) << "position view at" << index << "in section" << s << "at" << geometry << "mode" << mode;
+    q->setContentY(contentYFor(geometry, mode));
+
+    positionIndex = index;
+    positionMode = mode;
+    layoutDirty = true;
+    layout();
+}
+
+// Ranges of view indices for items intersecting rect in content coordinates, in order.
+// Sections are found by sectionHeights. A section that rect covers from edge to edge is one
+// range without looking at its rows; others are laid out if needed and searched by row.
+QVector<QPair<int, int>> FlexViewPrivate::indicesInRect(const QRectF &rect)
+{
+    QVector<QPair<int, int>> ranges;
+    applyPendingChanges();
+    if (rect.isEmpty() || sections.isEmpty())
+        return ranges;
+
+    FLEX_TRACE_SCOPE("FlexViewPrivate::indicesInRect");
+    updateSectionProperties();
+    bool fullWidth = rect.left() <= 0 && rect.right() >= q->width();
+    bool laidOut = false;
+    for (int s = sectionAtY(rect.top()); s < sections.size() && sectionY(s) < rect.bottom(); s++) {
+        FlexSection *section = sections[s];
+        if (section->count < 1)
+            continue;
+
+        qreal y = sectionY(s);
+        if (fullWidth && y + section->contentOffset() >= rect.top() && y + section->height() <= rect.bottom()) {
+            int start = section->viewStart();
+            int end = start + section->count - 1;
+            if (!ranges.isEmpty() && ranges.last().second == start - 1)
+                ranges.last().second = end;
+            else
+                ranges.append({start, end});
             continue;
         }
 
-        FlexSectionItem *sectionItem = section->ensureItem();
-        if (!sectionItem)
-            return;
-        sectionItem->item()->setPosition(QPointF(x, y));
-        sectionItem->item()->setImplicitWidth(viewportWidth);
-        sectionItem->item()->setImplicitHeight(section->contentHeight());
+        laidOut |= layoutSection(section);
+        y = sectionY(s) + section->contentOffset();
+        section->indicesIn(rect.translated(0, -y), ranges);
+    }
 
-        QRectF sectionVisibleArea = sectionItem->contentItem()->mapRectFromItem(q->contentItem(), visibleArea);
-        QRectF sectionCacheArea = sectionItem->contentItem()->mapRectFromItem(q->contentItem(), cacheArea);
-        section->layoutDelegates(sectionVisibleArea, sectionCacheArea);
+    if (laidOut)
+        invalidateLayout();
+    qCDebug(lcView) << "indices in" << rect << "are" << ranges;
+    return ranges;
+}
+
+// The geometry of index in content coordinates. Sections are loaded up to index, and only
+// its own section is laid out.
+QRectF FlexViewPrivate::geometryOf(int index)
+{
+    applyPendingChanges();
+    if (index < 0 || index >= count())
+        return QRectF();
+
+    updateSectionProperties();
+    while (loadedCount() <= index && refill())
+        ;
+    FlexSection *section = sectionOf(index);
+    if (!section)
+        return QRectF();
+    if (layoutSection(section))
+        invalidateLayout();
+
+    QRectF geometry = section->geometryOf(section->mapToSection(index));
+    if (geometry.isNull())
+        return QRectF();
+    return geometry.translated(0, sectionY(sectionIndexAt(index)) + section->contentOffset());
+}
+
+// The index nearest to x in the row delta rows after row in sections[s], or the first or
+// last row if that is past the ends. Sections are loaded and laid out only as the rows
+// reach them; laidOut is set if any were laid out.
+int FlexViewPrivate::indexAtRowOffset(int s, int row, int delta, qreal x, bool &laidOut)
+{
+    FlexSection *section = sections[s];
+    row += delta;
+    for (;;) {
+        if (row >= section->rowCount()) {
+            if (s >= sections.size() - 1 && !refill()) {
+                row = section->rowCount() - 1;
+                break;
+            }
+            row -= section->rowCount();
+            section = sections[++s];
+            laidOut |= layoutSection(section);
+        } else if (row < 0) {
+            if (s < 1) {
+                row = 0;
+                break;
+            }
+            section = sections[--s];
+            laidOut |= layoutSection(section);
+            row += section->rowCount();
+        } else {
+            break;
+        }
+    }
+
+    int i = section->rowIndexAt(row, x, true);
+    return i >= 0 ? section->mapToView(i) : -1;
+}
+
+// The index nearest to pos in content coordinates, in the first row that ends below it, or
+// the last row. Only the section at pos is laid out.
+int FlexViewPrivate::indexNearest(const QPointF &pos)
+{
+    applyPendingChanges();
+    updateSectionProperties();
+    while (sectionY(sections.size()) <= pos.y() && refill())
+        ;
+    if (sections.isEmpty())
+        return -1;
+
+    int s = std::min(sectionAtY(pos.y()), int(sections.size()) - 1);
+    FlexSection *section = sections[s];
+    if (layoutSection(section))
+        invalidateLayout();
+    int i = section->indexAtY(pos.y() - sectionY(s));
+    int row = i >= 0 ? section->rowForIndex(i) : section->rowCount() - 1;
+    i = section->rowIndexAt(row, pos.x(), true);
+    return i >= 0 ? section->mapToView(i) : -1;
+}
+
+// Whether section is among those laid out around the viewport by the last full pass, or
+// there is no section
+bool FlexViewPrivate::isActive(FlexSection *section) const
+{
+    if (!section)
+        return true;
+    return !sectionIndexDirty && activeFirst >= 0 && section->position >= activeFirst && section->position <= activeLast;
+}
+
+// Lay out section outside of a layout pass, for queries; true if it was dirty. Heights
+// after it may change, so the caller invalidates the layout to move section items.
+bool FlexViewPrivate::layoutSection(FlexSection *section)
+{
+    applySectionProperties(section);
+    return section->layout();
+}
+
+void FlexViewPrivate::setContentOrigin(qreal origin)
+{
+    if (origin == contentOrigin)
+        return;
+    qCDebug(lcLayout) << "content origin" << contentOrigin << "->" << origin;
+    contentOrigin = origin;
+    emit q->originYChanged();
+}
 
-        y += sectionItem->item()->height();
+// Remember the first visible row and its position in the content
+void FlexViewPrivate::updateAnchor(const QRectF &visibleArea)
+{
+    int s = sectionAtY(visibleArea.top());
+    FlexSection *section = s < sections.size() ? sections[s] : nullptr;
+    int i = (section && !section->isDirty()) ? section->indexAtY(visibleArea.top() - sectionY(s)) : -1;
+    if (i < 0) {
+        anchorRow = QPersistentModelIndex();
+        return;
     }
 
-    updateContentHeight(y);
+    int row = section->mapToView(i);
+    if (!anchorRow.isValid() || anchorRow.row() != row)
+        anchorRow = model->index(row, 0);
+    // Image headers are read nearest to the top of the viewport first
+    if (ratioProvider)
+        ratioProvider->setFocusRow(row);
+    anchorY = sectionY(s) + section->indexY(i);
 }
 
-void FlexViewPrivate::updateContentHeight(qreal layoutHeight)
+// How far the anchor row has moved in the content since updateAnchor. The model keeps
+// anchorRow up to date through inserts, removes and moves. Its section is laid out to
+// find the new position.
+qreal FlexViewPrivate::anchorDelta()
 {
-    if (sections.isEmpty()) {
-        q->setContentHeight(layoutHeight);
+    if (!anchorRow.isValid() || anchorRow.model() != model)
+        return 0;
+    FlexSection *section = sectionOf(anchorRow.row());
+    if (!section)
+        return 0;
+    applySectionProperties(section);
+    section->layout();
+    qreal y = section->indexY(section->mapToSection(anchorRow.row()));
+    if (y < 0)
+        return 0;
+    return sectionY(section->position) + y - anchorY;
+}
+
+// Keep the target of positionViewAtIndex in place after the layout pass changed heights
+void FlexViewPrivate::correctPosition()
+{
+    FlexSection *section = sectionOf(positionIndex);
+    FlexSectionItem *sectionItem = section ? section->ensureItem() : nullptr;
+    if (!sectionItem) {
+        positionIndex = -1;
+        return;
+    }
+
+    QRectF geometry = sectionItem->contentItem()->mapRectToItem(q->contentItem(), section->geometryOf(section->mapToSection(positionIndex)));
+    qreal contentY = contentYFor(geometry, positionMode);
+    if (qAbs(contentY - q->contentY()) < 0.5)
         return;
+    qCDebug(lcView) << "correcting position of" << positionIndex << "from" << q->contentY() << "to" << contentY;
+    q->setContentY(contentY);
+    layoutDirty = true;
+}
+
+qreal FlexViewPrivate::contentYFor(const QRectF &geometry, FlexView::PositionMode mode) const
+{
+    qreal contentY = q->contentY();
+    switch (mode) {
+    case FlexView::Beginning:
+        contentY = geometry.top();
+        break;
+    case FlexView::Center:
+        contentY = geometry.center().y() - q->height() / 2;
+        break;
+    case FlexView::End:
+        contentY = geometry.bottom() - q->height();
+        break;
+    case FlexView::Contain:
+        if (geometry.bottom() > contentY + q->height())
+            contentY = geometry.bottom() - q->height();
+        if (geometry.top() < contentY)
+            contentY = geometry.top();
+        break;
     }
 
-    int lastIndex = sections.last()->mapToView(sections.last()->count-1);
-    int remaining = count() - lastIndex - 1;
+    // The estimated contentHeight may not include the target yet
+    qreal maxY = std::max(q->originY() + q->contentHeight(), geometry.bottom()) - q->height();
+    return std::max(q->originY(), std::min(contentY, maxY));
+}
+
+// Update delegates for a change of contentY only, without the full layout pass. Sections
+// above and below the active range from the last full layout keep their positions, and
+// sections within it are already laid out, so only delegates at the edges of the cache
+// area are created or released. Returns false if a full layout is needed instead.
+bool FlexViewPrivate::layoutViewport(const QRectF &visibleArea, const QRectF &cacheArea)
+{
+    if (activeFirst < 0 || visibleArea.x() != laidOutArea.x() || visibleArea.size() != laidOutArea.size())
+        return false;
+    // The cache area must not reach a section that wasn't active, which would be
+    // created with a new height. Nothing is above the first section or below the last.
+    if (cacheArea.top() < activeTop && activeFirst > 0)
+        return false;
+    if (cacheArea.bottom() > activeBottom && (activeLast < sections.size() - 1 || loadedCount() < count()))
+        return false;
+
+    FLEX_TRACE_SCOPE("FlexViewPrivate::layoutViewport");
+    qCDebug(lcLayout) << "layout viewport" << visibleArea << "for sections" << activeFirst << "to" << activeLast;
+    stats->current.viewportLayouts++;
+
+    qreal y = activeTop;
+    for (int s = activeFirst; s <= activeLast; s++) {
+        FlexSection *section = sections[s];
+        if (!cacheArea.intersects(QRectF(0, y, visibleArea.width(), section->height()))) {
+            if (section != currentSection)
+                section->releaseSectionDelegate();
+        } else if (!layoutSectionItem(section, y, visibleArea, cacheArea)) {
+            return false;
+        }
+        y += section->height() + sectionSpacing;
+    }
+
+    laidOutArea = visibleArea;
+    return true;
+}
+
+// contentHeight is the sum of section heights, which are exact for laid out sections and
+// estimated for the others, plus an estimate for rows that aren't in sections yet.
+void FlexViewPrivate::updateContentHeight()
+{
+    int loaded = loadedCount();
+    int remaining = count() - loaded;
+    qreal height = sectionHeights.total();
     qreal estimated = 0;
 
-    if (layoutHeight > 0 && lastIndex > 0 && remaining > 0) {
-        // Average the height-per-item for the remaining rows
-        estimated = (layoutHeight / lastIndex) * remaining;
-        qCDebug(lcLayout) << "contentHeight:" << (layoutHeight + estimated) << "with"
-            << layoutHeight << "for existing" << lastIndex << "items, estimated"
-            << estimated << "for remaining" << remaining << "items";
-    } else if (q->contentHeight() != layoutHeight) {
-        qCDebug(lcLayout) << "contentHeight:" << q->contentHeight() << "->" << layoutHeight + estimated;
+    if (remaining > 0) {
+        // As one section without a layout, with headers as often as in loaded sections
+        qreal headers = loaded > 0 ? qreal(remaining) * sections.size() / loaded : 1;
+        estimated = estimateRowsHeight(remaining) + headers * (sectionHeaderHeight + sectionSpacing);
     }
+    if (!sections.isEmpty() || remaining > 0)
+        estimated -= sectionSpacing;
 
-    q->setContentHeight(layoutHeight + estimated);
+    if (q->contentHeight() != height + estimated) {
+        qCDebug(lcLayout) << "contentHeight:" << q->contentHeight() << "->" << (height + estimated) << "with"
+            << height << "for" << sections.size() << "sections, estimated" << estimated << "for remaining" << remaining << "items";
+    }
+    q->setContentHeight(height + estimated);
 }
 
 bool FlexViewPrivate::applyPendingChanges()
@@ -556,156 +1617,190 @@ bool FlexViewPrivate::applyPendingChanges()
     if (pendingChanges.isEmpty() || !q->isComponentComplete())
         return false;
 
+    FlexTraceScope trace("FlexViewPrivate::applyPendingChanges");
+    updateTimer.stop();
+    layoutDirty = true;
+    trace.arg("removes", pendingChanges.removes().size());
+    trace.arg("inserts", pendingChanges.inserts().size());
+    trace.arg("changes", pendingChanges.changes().size());
+
     int oldCurrentIndex = currentIndex;
     QPointer<FlexSection> oldCurrentSection(currentSection);
 
+    // Data and delegates of moved rows by (moveId, offset), between their remove and insert
+    std::map<std::pair<int, int>, ModelData> moved;
+    std::pair<int, int> currentMove(-1, -1);
+    // Selected ranges of moved rows by moveId, as offsets in the move
+    QHash<int, QVector<FlexSelection::Range>> movedSelection;
+    // Shared with the selection until it changes
+    const QVector<FlexSelection::Range> oldSelection = selection.ranges();
+
+    for (const auto &change : pendingChanges.removes())
+        stats->current.pendingChanges += change.count;
+    for (const auto &change : pendingChanges.inserts())
+        stats->current.pendingChanges += change.count;
+    for (const auto &change : pendingChanges.changes())
+        stats->current.pendingChanges += change.count;
+
     for (const auto &remove : pendingChanges.removes()) {
         int first = remove.start();
         int count = remove.count;
         items.adjustIndex(first, -count);
+        if (remove.isMove()) {
+            for (const auto &range : selection.rangesIn(first, first + count - 1))
+                movedSelection[remove.moveId].append({range.first - first + remove.offset, range.second - first + remove.offset});
+        }
+        selection.remove(first, count);
 
-        for (FlexSection *section : sections) {
-            if (!count) {
-                section->viewStart -= remove.count;
-                continue;
-            }
-
-            int sectionFirst = section->mapToSection(first);
-            if (sectionFirst < 0)
-                continue;
+        // Later rows move down to 'first' as rows are removed, so it stays the same
+        for (int s = sectionIndexAt(first); count > 0 && s < sections.size(); s++) {
+            FlexSection *section = sections[s];
+            int sectionFirst = first - section->viewStart();
             int sectionCount = std::min(count, section->count - sectionFirst);
+            if (sectionCount <= 0)
+                continue;
 
+            if (remove.isMove()) {
+                int offset = remove.offset + remove.count - count;
+                for (int i = 0; i < sectionCount; i++) {
+                    ModelData data = section->takeData(sectionFirst + i);
+                    if (data.delegate || data.size)
+                        moved.emplace(std::make_pair(remove.moveId, offset + i), std::move(data));
+                }
+            }
             section->remove(sectionFirst, sectionCount);
-            section->viewStart -= first - remove.start();
-
-            first += sectionCount;
             count -= sectionCount;
         }
 
-        if (currentIndex >= first) {
-            if (currentIndex < first + count)
+        if (currentIndex >= remove.start()) {
+            if (currentIndex < remove.end()) {
+                if (remove.isMove())
+                    currentMove = {remove.moveId, remove.offset + currentIndex - remove.start()};
                 currentIndex = -1;
+            }
             else
-                currentIndex -= count;
+                currentIndex -= remove.count;
         }
     }
 
     for (const auto &insert : pendingChanges.inserts()) {
         int index = insert.start();
         int count = insert.count;
-
         items.adjustIndex(index, count);
+        selection.insert(index, count);
 
-        for (int s = 0; s < sections.size(); s++) {
+        // Inserts at or past the end of the last section are left for refill
+        int s = sectionIndexAt(index);
+        if (s < sections.size()) {
             FlexSection *section = sections[s];
-            if (section->viewStart >= index + count) {
-                section->viewStart += count;
-                continue;
-            } else if (section->viewStart < index) {
-                continue;
+            auto runs = sectionRuns(index, count);
+            if (runs.size() == 1 && runs[0].first == section->value) {
+                qCDebug(lcView) << "inserting to section" << section << "at" << section->viewStart() << "from" << index - section->viewStart() << "count" << count;
+                section->insert(index - section->viewStart(), count);
+            } else {
+                replaceRows(s, index - section->viewStart(), 0, runs);
             }
-
-            bool createdSection = false;
-            int from = 0;
-            for (int i = 0; i < count; i++) {
-                QString value = sectionValue(index + i);
-                if (value == section->value)
-                    continue;
-
-                if (!createdSection && index != section->viewStart + section->count) {
-                    // Split original section before inserting
-                    FlexSection *suffix = new FlexSection(this, section->value);
-                    // Suffix has viewStart _before_ the insert, so it offsets correctly after
-                    suffix->viewStart = index;
-                    int splitFirst = index - section->viewStart;
-                    int splitCount = section->count - splitFirst;
-                    suffix->insert(0, splitCount);
-                    sections.insert(s + 1, suffix);
-                    section->remove(splitFirst, splitCount);
-                }
-                createdSection = true;
-
-                // Always appending at this point
-                if (i > from)
-                    section->insert(section->count, i - from);
-                from = i;
-
-                s++;
-                section = new FlexSection(this, value);
-                section->viewStart = index + from;
-                sections.insert(s, section);
-            }
-            qCDebug(lcView) << "inserting to section" << section << "at" << section->viewStart << "from" << index - section->viewStart << "count" << count - from;
-
-            if (createdSection)
-                section->insert(0, count - from);
-            else
-                section->insert(index - section->viewStart, count - from);
         }
 
         if (currentIndex >= index)
             currentIndex += count;
+
+        if (insert.isMove()) {
+            restoreMoved(s, insert, moved);
+            for (const auto &range : movedSelection.value(insert.moveId)) {
+                int first = std::max(range.first, insert.offset);
+                int last = std::min(range.second, insert.offset + count - 1);
+                selection.select(index + first - insert.offset, index + last - insert.offset);
+            }
+            if (currentMove.first == insert.moveId && currentMove.second >= insert.offset
+                && currentMove.second < insert.offset + count)
+            {
+                currentIndex = index + currentMove.second - insert.offset;
+            }
+        }
     }
 
     for (const auto &change : pendingChanges.changes()) {
         int first = change.start();
-        int count = change.count;
+        int end = change.end();
 
-        for (int s = 0; s < sections.size(); s++) {
+        for (int s = sectionIndexAt(first); s < sections.size() && first < end; s++) {
             FlexSection *section = sections[s];
             int sectionFirst = section->mapToSection(first);
             if (sectionFirst < 0)
                 continue;
-            int sectionCount = std::min(count, section->count - sectionFirst);
-
-            for (int i = 0; i < sectionCount; i++) {
-                QString value = sectionValue(section->mapToView(sectionFirst + i));
-                if (value == section->value)
-                    continue;
+            int sectionCount = std::min(end - first, section->count - sectionFirst);
 
-                section->remove(sectionFirst + i, sectionCount - i);
-
-                FlexSection *newSection = new FlexSection(this, value);
-                newSection->viewStart = section->mapToView(sectionFirst + i);
-                newSection->insert(0, sectionCount - i);
-                sections.insert(s+1, newSection);
-
-                sectionCount = i;
-                break;
-            }
-
-            if (sectionCount > 0) {
+            auto runs = sectionRuns(first, sectionCount);
+            if (runs.size() == 1 && runs[0].first == section->value) {
                 section->change(sectionFirst, sectionCount);
-                first += sectionCount;
-                count -= sectionCount;
+            } else {
+                // Sections split by replaceRows are after s, and don't overlap the remaining range
+                int oldSize = sections.size();
+                replaceRows(s, sectionFirst, sectionCount, runs);
+                s += sections.size() - oldSize;
             }
-
-            if (!count)
-                break;
+            first += sectionCount;
         }
     }
 
-    for (int s = 0; s < sections.size(); s++) {
+    mergeSections();
+    pendingChanges.clear();
+    const QVector<PendingData> data = std::exchange(pendingData, {});
+    for (const PendingData &change : data)
+        items.dataChanged(change.first, change.last, change.roles);
+    updateCurrentSection(oldCurrentIndex, oldCurrentSection);
+    if (selection.ranges() != oldSelection) {
+        // Any delegate may have moved relative to the selection. If the ranges are the
+        // same, selected rows kept their index and moved rows took their selection along.
+        updateSelected(0, INT_MAX);
+        emit q->selectionChanged();
+    }
+    return true;
+}
+
+// Remove empty sections and merge neighbours with the same value. Only mergeCandidates
+// are checked, from the last, so merging one doesn't move the sections before it.
+void FlexViewPrivate::mergeSections()
+{
+    if (mergeCandidates.isEmpty())
+        return;
+    updateSectionIndex();
+    QVector<int> positions;
+    positions.reserve(mergeCandidates.size());
+    for (FlexSection *section : qAsConst(mergeCandidates))
+        positions.append(section->position);
+    std::sort(positions.begin(), positions.end());
+
+    for (int i = positions.size() - 1; i >= 0; i--)
+        mergeSectionAt(positions[i]);
+    mergeCandidates.clear();
+}
+
+// Remove section s if it's empty, or merge it into the section before it if they have the
+// same value, until the section at s is neither
+void FlexViewPrivate::mergeSectionAt(int s)
+{
+    while (s < sections.size()) {
         FlexSection *section = sections[s];
         if (section->count == 0) {
             section->deleteLater();
-            sections.removeAt(s);
-            s--;
-            continue;
-        }
-
-        if (s > 0 && section->value == sections[s-1]->value) {
+            removeSection(s);
+        } else if (s > 0 && section->value == sections[s-1]->value) {
             FlexSection *prev = sections[s-1];
-            prev->insert(prev->count, section->count);
+            section->moveRows(0, section->count, prev, prev->count);
             section->deleteLater();
-            sections.removeAt(s);
-            s--;
-            continue;
+            removeSection(s);
+        } else {
+            break;
         }
     }
+}
 
-    pendingChanges.clear();
-
+// Update currentSection and the sections' current index after currentIndex was adjusted
+// for changes, and emit changes to the view's current index and section
+void FlexViewPrivate::updateCurrentSection(int oldCurrentIndex, QPointer<FlexSection> oldCurrentSection)
+{
     if (currentIndex < 0 && oldCurrentIndex >= 0) {
         // setCurrentIndex clears the current item as well
         currentIndex = oldCurrentIndex;
@@ -725,37 +1820,96 @@ bool FlexViewPrivate::applyPendingChanges()
         if (currentSection != oldCurrentSection || !currentSection)
             emit q->currentSectionChanged();
     }
-
-    return true;
 }
 
-void FlexViewPrivate::validateSections()
+bool FlexViewPrivate::validateSections()
 {
+    bool valid = true;
     int modelCount = count();
     FlexSection *prevSection = nullptr;
+    int expectedStart = 0;
+    qreal expectedY = contentOrigin;
+    updateSectionIndex();
     for (int s = 0; s < sections.size(); s++) {
         FlexSection *section = sections[s];
-        if ((prevSection && prevSection->viewStart + prevSection->count != section->viewStart) || (!prevSection && section->viewStart > 0)) {
-            qCWarning(lcLayout) << "section" << s << "viewStart" << section->viewStart << "expected" << (prevSection ? prevSection->viewStart + prevSection->count : 0);
+        if (section->position != s || section->viewStart() != expectedStart) {
+            qCWarning(lcLayout) << "section" << s << "at position" << section->position << "viewStart" << section->viewStart() << "expected" << expectedStart;
+            valid = false;
         }
+        expectedStart += section->count;
+        if (!qFuzzyCompare(1 + sectionY(s), 1 + expectedY)) {
+            qCWarning(lcLayout) << "section" << s << "at y" << sectionY(s) << "expected" << expectedY;
+            valid = false;
+        }
+        expectedY += section->height() + sectionSpacing;
         if (section->count < 1) {
             qCWarning(lcLayout) << "section" << s << "is empty";
+            valid = false;
         }
-        if (section->viewStart + section->count > modelCount) {
-            qCWarning(lcLayout) << "section" << s << "goes past model count" << modelCount << "with" << section->viewStart << section->count;
+        if (section->viewStart() + section->count > modelCount) {
+            qCWarning(lcLayout) << "section" << s << "goes past model count" << modelCount << "with" << section->viewStart() << section->count;
+            valid = false;
         }
         if (prevSection && prevSection->value == section->value) {
             qCWarning(lcLayout) << "section" << s << "should merge with previous section";
+            valid = false;
         }
         prevSection = section;
     }
+    return valid;
+}
+
+// In addition to validateSections, check every section against the model and against a
+// layout from scratch, and check delegate indices. This is expensive; it's meant for the
+// change benchmark and for debugging change handling.
+bool FlexViewPrivate::validateLayout()
+{
+    if (!validateSections())
+        return false;
+
+    bool valid = true;
+    for (int s = 0; s < sections.size(); s++) {
+        FlexSection *section = sections[s];
+        for (int i = 0; i < section->count; i++) {
+            QString value = sectionValue(section->mapToView(i));
+            if (value != section->value) {
+                qCWarning(lcLayout) << "section" << s << "with value" << section->value << "contains index" << section->mapToView(i) << "with value" << value;
+                valid = false;
+                break;
+            }
+        }
+        if (!section->validate())
+            valid = false;
+    }
+
+    if (currentIndex >= 0 && currentSection && currentSection->mapToSection(currentIndex) < 0) {
+        qCWarning(lcLayout) << "current index" << currentIndex << "is not in current section";
+        valid = false;
+    }
+
+    if (!items.validate())
+        valid = false;
+    return valid;
 }
 
 bool FlexViewPrivate::refill()
 {
+    FLEX_TRACE_SCOPE("FlexViewPrivate::refill");
     FlexSection *section = sections.isEmpty() ? nullptr : sections.last();
     int lastIndex = section ? section->mapToView(section->count - 1) : -1;
 
+    // Rows are added to each section at once, as that updates the section's height
+    int added = 0;
+    auto addRows = [&]() {
+        if (!added)
+            return;
+        section->insert(section->count, added);
+        int first = section->viewStart() + section->count - added;
+        if (currentIndex >= first && currentIndex < first + added)
+            section->setCurrentIndex(section->mapToSection(currentIndex));
+        added = 0;
+    };
+
     bool sectionAdded = false;
     int modelCount = count();
     for (int i = lastIndex+1; i < modelCount; i++) {
@@ -763,19 +1917,86 @@ bool FlexViewPrivate::refill()
         if (!section || value != section->value) {
             if (sectionAdded)
                 break;
+            addRows();
             section = new FlexSection(this, value);
-            section->viewStart = i;
-            sections.append(section);
+            insertSection(sections.size(), section);
             sectionAdded = true;
         }
-        section->insert(section->count, 1);
-        if (i == currentIndex)
-            section->setCurrentIndex(section->mapToSection(i));
+        added++;
     }
+    addRows();
 
     return sectionAdded;
 }
 
+// Group count rows starting at index into runs with the same section value
+QVector<QPair<QString, int>> FlexViewPrivate::sectionRuns(int index, int count)
+{
+    QVector<QPair<QString, int>> runs;
+    for (int i = index; i < index + count; i++) {
+        QString value = sectionValue(i);
+        if (runs.isEmpty() || runs.last().first != value)
+            runs.append({value, 1});
+        else
+            runs.last().second++;
+    }
+    return runs;
+}
+
+// Replace 'removed' rows at 'first' in sections[s] with runs of new rows. The section is split
+// around them and each run becomes a new section; applyPendingChanges merges neighbours with
+// equal values afterwards.
+void FlexViewPrivate::replaceRows(int s, int first, int removed, const QVector<QPair<QString, int>> &runs)
+{
+    FlexSection *section = sections[s];
+    int at = s + 1;
+    FlexSection *suffix = nullptr;
+    if (first == 0) {
+        // Nothing before the new rows, so the original section becomes the suffix
+        if (removed)
+            section->remove(0, removed);
+        at = s;
+    } else {
+        int suffixCount = section->count - first - removed;
+        if (suffixCount > 0) {
+            suffix = new FlexSection(this, section->value);
+            section->moveRows(first + removed, suffixCount, suffix, 0);
+        }
+        if (removed)
+            section->remove(first, removed);
+    }
+
+    for (const auto &run : runs) {
+        FlexSection *newSection = new FlexSection(this, run.first);
+        newSection->insert(0, run.second);
+        insertSection(at++, newSection);
+    }
+    if (suffix)
+        insertSection(at, suffix);
+}
+
+// Give rows inserted by a move the data and delegates they had before it. The inserted
+// rows start in sections[s], and may continue into sections split from it.
+void FlexViewPrivate::restoreMoved(int s, const QQmlChangeSet::Change &insert, std::map<std::pair<int, int>, ModelData> &moved)
+{
+    for (int i = 0; i < insert.count && s < sections.size(); i++) {
+        auto it = moved.find({insert.moveId, insert.offset + i});
+        if (it == moved.end())
+            continue;
+
+        int index = insert.start() + i;
+        while (s < sections.size() && sections[s]->mapToSection(index) < 0)
+            s++;
+        if (s >= sections.size())
+            break;
+
+        if (it->second.delegate)
+            items.restoreItem(index, it->second.delegate);
+        sections[s]->putData(sections[s]->mapToSection(index), std::move(it->second));
+        moved.erase(it);
+    }
+}
+
 QString FlexViewPrivate::sectionValue(int index)
 {
     if (!model || sectionRole.isEmpty() || sectionRoleIdx < -1)
@@ -789,35 +2010,151 @@ QString FlexViewPrivate::sectionValue(int index)
         }
     }
 
+    stats->current.dataCalls++;
     return model->data(model->index(index, 0), sectionRoleIdx).toString();
 }
 
+// The ratio from sizeRole, or from ratioSourceRole when the model doesn't have one. Rows
+// waiting for ratioSourceRole get the mean ratio of laid out sections as a placeholder,
+// and are changed when it's loaded.
 qreal FlexViewPrivate::indexFlexRatio(int index)
 {
-    if (!model || sizeRole.isEmpty() || sizeRoleIdx < -1)
+    qreal ratio = modelFlexRatio(index);
+    if (ratio > 0)
+        return ratio;
+    if (ratioSourceRole.isEmpty())
         return 1;
 
+    ratio = sourceFlexRatio(index);
+    if (ratio > 0)
+        return ratio;
+    return ratioCount > 0 ? ratioSum / ratioCount : 1;
+}
+
+// The ratio from sizeRole, or 0 if it's missing
+qreal FlexViewPrivate::modelFlexRatio(int index)
+{
+    if (!model || sizeRole.isEmpty() || sizeRoleIdx < -1)
+        return 0;
+
     if (sizeRoleIdx < 0) {
         sizeRoleIdx = model->roleNames().key(sizeRole.toLatin1(), -2);
         if (sizeRoleIdx < 0) {
             qCWarning(lcView) << "Model does not contain role" << sizeRole << "for sizes";
-            return 1;
+            return 0;
         }
     }
 
+    stats->current.dataCalls++;
     QVariant value = model->data(model->index(index, 0), sizeRoleIdx);
     if (value.canConvert<QSizeF>()) {
         QSizeF sz = value.value<QSizeF>();
-        if (!sz.isEmpty())
-            return sz.width() / sz.height();
-        else
-            return 1;
+        return sz.isEmpty() ? 0 : sz.width() / sz.height();
     } else if (value.canConvert<qreal>()) {
         return value.value<qreal>();
+    } else if (!value.isValid() && !ratioSourceRole.isEmpty()) {
+        return 0;
     } else {
         qCWarning(lcView) << "Invalid value" << value << "for sizeRole on index" << index;
+        return 0;
+    }
+}
+
+// The ratio of the local image file from ratioSourceRole, or 0 while it's being read.
+// Anything but a local file has a ratio of 1.
+qreal FlexViewPrivate::sourceFlexRatio(int index)
+{
+    QString path = sourcePath(index);
+    if (path.isEmpty())
         return 1;
+
+    if (!ratioProvider) {
+        ratioProvider = new FlexRatioProvider(this);
+        connect(ratioProvider, &FlexRatioProvider::ratiosLoaded, this, &FlexViewPrivate::ratiosLoaded);
+    }
+    return ratioProvider->ratio(path, model->index(index, 0));
+}
+
+QString FlexViewPrivate::sourcePath(int index)
+{
+    return localFilePath(index, ratioSourceRole, ratioSourceRoleIdx);
+}
+
+QString FlexViewPrivate::tilePath(int index)
+{
+    return localFilePath(index, tileRole, tileRoleIdx);
+}
+
+// The local file path from role, or an empty string if it's not a local file
+QString FlexViewPrivate::localFilePath(int index, const QString &role, int &roleIdx)
+{
+    if (!model || role.isEmpty() || roleIdx < -1)
+        return QString();
+
+    if (roleIdx < 0) {
+        roleIdx = model->roleNames().key(role.toLatin1(), -2);
+        if (roleIdx < 0) {
+            qCWarning(lcView) << "Model does not contain role" << role << "for image files";
+            return QString();
+        }
+    }
+
+    stats->current.dataCalls++;
+    QVariant value = model->data(model->index(index, 0), roleIdx);
+    QUrl url = value.toUrl();
+    return url.isLocalFile() ? url.toLocalFile() : (url.isRelative() ? value.toString() : QString());
+}
+
+// Queue thumbnails for rows in the cache area ahead of the viewport in the direction of
+// scrolling, nearest first. Visible rows have delegates or tiles that request their own.
+// Thumbnails are only prefetched if the flexthumb provider is installed.
+void FlexViewPrivate::prefetchThumbnails(const QRectF &visibleArea, const QRectF &cacheArea)
+{
+    if ((ratioSourceRole.isEmpty() && tileRole.isEmpty()) || !q->window())
+        return;
+    FlexThumbnailProvider *provider = FlexThumbnailProvider::forEngine(qmlEngine(q));
+    if (!provider)
+        return;
+
+    // Delegates and tiles in the cache area already request their own thumbnails, so the
+    // prefetch is the same distance again past it, in the direction of scrolling. Sections
+    // there that aren't laid out are skipped rather than laid out early.
+    bool down = visibleArea.top() >= prefetchTop;
+    prefetchTop = visibleArea.top();
+    qreal ahead = std::max(cacheBuffer, visibleArea.height());
+    qreal top = down ? cacheArea.bottom() : cacheArea.top() - ahead;
+    qreal bottom = down ? cacheArea.bottom() + ahead : cacheArea.top();
+    qreal dpr = q->window()->effectiveDevicePixelRatio();
+
+    QVector<QPair<QString, QSize>> prefetch;
+    for (int s = sectionAtY(top); s < sections.size() && sectionY(s) <= bottom; s++) {
+        FlexSection *section = sections[s];
+        if (section->isDirty())
+            continue;
+        qreal y = sectionY(s) + section->contentOffset();
+        for (const auto &item : section->geometriesIn(top - y, bottom - y)) {
+            int index = section->mapToView(item.first);
+            QString path = tileRole.isEmpty() ? sourcePath(index) : tilePath(index);
+            if (!path.isEmpty())
+                prefetch.append({path, (item.second.size() * dpr).toSize()});
+        }
+    }
+    if (!down)
+        std::reverse(prefetch.begin(), prefetch.end());
+    provider->prefetch(prefetch);
+}
+
+// Loaded ratios are applied like a change to the size role, in runs of rows
+void FlexViewPrivate::ratiosLoaded(const QVector<int> &rows)
+{
+    for (int i = 0; i < rows.size(); ) {
+        int end = i + 1;
+        while (end < rows.size() && rows[end] == rows[end - 1] + 1)
+            end++;
+        pendingChanges.change(rows[i], end - i);
+        i = end;
     }
+    scheduleUpdate();
 }
 
 void FlexViewPrivate::itemGeometryChanged(QQuickItem *item, QQuickGeometryChange change, const QRectF &)
@@ -827,15 +2164,309 @@ void FlexViewPrivate::itemGeometryChanged(QQuickItem *item, QQuickGeometryChange
 
     qCDebug(lcLayout) << "section item geometry changed" << item;
     Q_UNUSED(item);
-    q->polish();
+    invalidateLayout();
 }
 
-FlexSection *FlexViewPrivate::sectionOf(int index) const
+FlexSection *FlexViewPrivate::sectionOf(int index)
 {
-    auto it = std::lower_bound(sections.begin(), sections.end(), index, [](FlexSection *s, int i) { return s->mapToView(s->count-1) < i; });
-    if (it == sections.end())
+    int s = sectionIndexAt(index);
+    if (s >= sections.size())
         return nullptr;
-    Q_ASSERT((*it)->mapToSection(index) >= 0);
-    return *it;
+    Q_ASSERT(sections[s]->mapToSection(index) >= 0);
+    return sections[s];
+}
+
+// The position of the first section that ends after index, which is the section containing
+// index unless index is past the loaded sections
+int FlexViewPrivate::sectionIndexAt(int index)
+{
+    if (index < 0)
+        return sections.size();
+    updateSectionIndex();
+    return sectionCounts.upperBound(index);
+}
+
+// Number of rows in loaded sections
+int FlexViewPrivate::loadedCount()
+{
+    updateSectionIndex();
+    return sectionCounts.total();
+}
+
+// Positions, sectionCounts and sectionHeights are updated from at onwards, so appends (as
+// by refill) are O(log n) and other changes O(sections after at). Sections removed from
+// the list are not deleted.
+void FlexViewPrivate::insertSection(int at, FlexSection *section)
+{
+    Q_ASSERT(section->position < 0);
+    sections.insert(at, section);
+    mergeCandidates.insert(section);
+    if (at + 1 < sections.size())
+        mergeCandidates.insert(sections[at + 1]);
+    // The active range still holds what the last full pass laid out only if it's after at
+    if (at <= activeFirst) {
+        activeFirst++;
+        activeLast++;
+    } else if (at <= activeLast) {
+        activeFirst = activeLast = -1;
+    }
+    if (sectionIndexDirty) {
+        section->position = at;
+    } else {
+        for (int s = at; s < sections.size(); s++)
+            sections[s]->position = s;
+        sectionCounts.insert(at, section->count);
+        sectionHeights.insert(at, section->height() + sectionSpacing);
+        section->updateHeight();
+    }
+    ratioSum += section->ratioSum();
+    ratioCount += section->ratioCount();
+    sectionGeneration++;
+}
+
+void FlexViewPrivate::removeSection(int at)
+{
+    FlexSection *section = sections.takeAt(at);
+    section->position = -1;
+    mergeCandidates.remove(section);
+    if (at < sections.size())
+        mergeCandidates.insert(sections[at]);
+    if (at < activeFirst) {
+        activeFirst--;
+        activeLast--;
+    } else if (at <= activeLast) {
+        activeFirst = activeLast = -1;
+    }
+    if (!sectionIndexDirty) {
+        for (int s = at; s < sections.size(); s++)
+            sections[s]->position = s;
+        sectionCounts.remove(at);
+        sectionHeights.remove(at);
+    }
+    ratioSum -= section->ratioSum();
+    ratioCount -= section->ratioCount();
+    sectionGeneration++;
+}
+
+void FlexViewPrivate::sectionCountChanged(FlexSection *section, int delta)
+{
+    if (section->position >= 0 && !section->count)
+        mergeCandidates.insert(section);
+    if (sectionIndexDirty || section->position < 0)
+        return;
+    Q_ASSERT(sections.value(section->position) == section);
+    sectionCounts.add(section->position, delta);
+    sectionGeneration++;
+}
+
+void FlexViewPrivate::sectionHeightChanged(FlexSection *section, qreal delta)
+{
+    if (sectionIndexDirty || section->position < 0)
+        return;
+    Q_ASSERT(sections.value(section->position) == section);
+    sectionHeights.add(section->position, delta);
+}
+
+void FlexViewPrivate::sectionRatiosChanged(FlexSection *section, qreal sumDelta, int countDelta)
+{
+    if (section->position < 0)
+        return;
+    ratioSum += sumDelta;
+    ratioCount += countDelta;
+}
+
+void FlexViewPrivate::sectionLoaded(FlexSection *section)
+{
+    if (section->position >= 0)
+        loadedSections.append(section);
+}
+
+// Compact loaded sections that are further than retain from the area. Their heights don't
+// change, so nothing moves. Only sections that were loaded are visited, which are the ones
+// the viewport passed near since they were last compacted.
+void FlexViewPrivate::compactSections(const QRectF &area, qreal retain)
+{
+    QRectF retainArea(area.adjusted(0, -retain, 0, retain));
+    int compacted = 0;
+    for (auto it = loadedSections.begin(); it != loadedSections.end(); ) {
+        FlexSection *section = *it;
+        if (!section || section->position < 0 || section->isCompact()) {
+            it = loadedSections.erase(it);
+            continue;
+        }
+
+        qreal y = sectionY(section->position);
+        if (section->hasItem() || section == currentSection
+            || (y + section->height() >= retainArea.top() && y <= retainArea.bottom())) {
+            it++;
+            continue;
+        }
+
+        section->compact();
+        compacted++;
+        it = loadedSections.erase(it);
+    }
+
+    if (compacted)
+        qCDebug(lcLayout) << "compacted" << compacted << "sections beyond" << retainArea;
+}
+
+FlexMemoryUsage FlexViewPrivate::memoryUsage() const
+{
+    FlexMemoryUsage usage;
+    usage.liveDelegates.count = stats->liveDelegateCount;
+    usage.liveDelegates.bytes = stats->liveDelegateCount * delegateItemBytes;
+    usage.releasedDelegates.count = std::max(0, items.entryCount() - stats->liveDelegateCount);
+    usage.releasedDelegates.bytes = usage.releasedDelegates.count * DelegateManager::entrySize();
+
+    usage.sections.count = sections.size();
+    usage.sections.bytes = sections.size() * qint64(sizeof(FlexSection) + sizeof(FlexSection*) + sizeof(int) + sizeof(qreal));
+    for (const auto &section : activeSections) {
+        if (section && section->hasItem())
+            usage.sectionItems.count++;
+    }
+    usage.sectionItems.bytes = usage.sectionItems.count * delegateItemBytes;
+
+    // Only loaded sections have sizes and rows
+    for (const auto &section : loadedSections) {
+        if (!section || section->isCompact())
+            continue;
+        usage.itemData.count += section->count;
+        usage.itemData.bytes += section->itemDataBytes();
+        usage.rows.count += section->rowCount();
+        usage.rows.bytes += section->rowBytes();
+    }
+
+    usage.caches.count = items.entryCount() - usage.releasedDelegates.count + persistentRows.size();
+    usage.caches.bytes = items.entryBytes() - usage.releasedDelegates.bytes
+        + persistentRows.capacity() * qint64(sizeof(QPersistentModelIndex))
+        + (activeSections.size() + loadedSections.size()) * qint64(sizeof(QPointer<FlexSection>));
+    if (ratioProvider) {
+        usage.caches.count += ratioProvider->cachedCount();
+        usage.caches.bytes += ratioProvider->cacheBytes();
+    }
+    return usage;
+}
+
+// Over budget, drop what can go without changing anything on screen or in the cache area
+void FlexViewPrivate::enforceMemoryBudget(const QRectF &cacheArea)
+{
+    qint64 budget = qint64(memoryBudget) * 1024;
+    qint64 total = memoryUsage().total();
+    if (total <= budget)
+        return;
+
+    items.trim();
+    compactSections(cacheArea, 0);
+    qint64 trimmed = memoryUsage().total();
+    qCDebug(lcView) << "memory usage" << total << "over budget" << budget << "trimmed to" << trimmed;
+    if (trimmed > budget)
+        qCDebug(lcView) << "memory usage is still over budget with only the cache area loaded";
+}
+
+void FlexViewPrivate::trimMemory(FlexView::TrimLevel level)
+{
+    qint64 before = memoryUsage().total();
+    QRectF visibleArea(q->contentX(), q->contentY(), q->width(), q->height());
+
+    if (level >= FlexView::TrimOffscreen) {
+        // A pass without the cache buffer releases everything outside of the viewport.
+        // Later passes fill the cache area again as the view moves.
+        QScopedValueRollback trim(trimCache, true);
+        layoutDirty = true;
+        layout();
+        compactSections(visibleArea, 0);
+    } else {
+        compactSections(visibleArea.adjusted(0, -cacheBuffer, 0, cacheBuffer), 0);
+    }
+
+    if (level >= FlexView::TrimAll) {
+        for (const auto &section : loadedSections) {
+            if (section)
+                section->squeeze();
+        }
+        persistentRows.squeeze();
+        // Loaded sections keep their ratios, and the rest read them again
+        if (ratioProvider)
+            ratioProvider->clear();
+    }
+    items.trim();
+
+    // Thumbnails are shared by every view in the engine, so only TrimAll drops them
+    if (FlexThumbnailProvider *provider = FlexThumbnailProvider::forEngine(qmlEngine(q)))
+        provider->trim(level < FlexView::TrimAll);
+
+    qCDebug(lcView) << "trimmed memory at level" << level << "from" << before << "to" << memoryUsage().total() << "bytes";
+}
+
+qint64 FlexMemoryUsage::total() const
+{
+    return liveDelegates.bytes + releasedDelegates.bytes + sectionItems.bytes + sections.bytes
+        + itemData.bytes + rows.bytes + caches.bytes;
+}
+
+QVariantMap FlexMemoryUsage::toMap() const
+{
+    auto category = [](const Category &c) {
+        return QVariantMap{{"count", c.count}, {"bytes", c.bytes}};
+    };
+    return QVariantMap{
+        {"liveDelegates", category(liveDelegates)},
+        {"releasedDelegates", category(releasedDelegates)},
+        {"sectionItems", category(sectionItems)},
+        {"sections", category(sections)},
+        {"itemData", category(itemData)},
+        {"rows", category(rows)},
+        {"caches", category(caches)},
+        {"total", total()},
+    };
+}
+
+void FlexViewPrivate::updateSectionIndex()
+{
+    if (!sectionIndexDirty)
+        return;
+
+    std::vector<int> counts(sections.size());
+    std::vector<qreal> heights(sections.size());
+    for (int s = 0; s < sections.size(); s++) {
+        sections[s]->position = s;
+        sections[s]->updateHeight();
+        counts[s] = sections[s]->count;
+        heights[s] = sections[s]->height() + sectionSpacing;
+    }
+    sectionCounts.assign(counts);
+    sectionHeights.assign(heights);
+    sectionIndexDirty = false;
+    sectionGeneration++;
+}
+
+// The content y of section s, or the end of loaded sections including spacing after the last
+qreal FlexViewPrivate::sectionY(int s)
+{
+    updateSectionIndex();
+    return contentOrigin + sectionHeights.prefix(s);
+}
+
+// The first section that ends after content y, counting the spacing after it
+int FlexViewPrivate::sectionAtY(qreal y)
+{
+    updateSectionIndex();
+    return sectionHeights.upperBound(y - contentOrigin);
+}
+
+// The height of count rows as one section without a header, assuming rows at idealHeight
+// with the mean ratio of laid out rows, or 4:3 if there are none
+qreal FlexViewPrivate::estimateRowsHeight(int count) const
+{
+    qreal width = q->width();
+    if (count < 1 || idealHeight <= 0 || width <= 0)
+        return 0;
+    qreal ratio = ratioCount > 0 ? ratioSum / ratioCount : 4. / 3.;
+    if (layoutMode == FlexView::GridLayout)
+        ratio = cellRatio;
+    qreal perRow = std::max(1., (width + hSpacing) / (ratio * idealHeight + hSpacing));
+    qreal rows = std::ceil(count / perRow);
+    return rows * idealHeight + (rows - 1) * vSpacing;
 }
 
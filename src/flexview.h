@@ -2,8 +2,11 @@
 
 #include <QtQuick/private/qquickflickable_p.h>
 #include <QAbstractItemModel>
+#include <QPointer>
 
 class FlexViewPrivate;
+class FlexViewStats;
+class FlexViewAttached;
 class QQmlComponent;
 class QAbstractItemModel;
 
@@ -16,18 +19,59 @@ class FlexView : public QQuickFlickable
     Q_PROPERTY(QQmlComponent* section READ section WRITE setSection NOTIFY sectionChanged)
     Q_PROPERTY(QString sectionRole READ sectionRole WRITE setSectionRole NOTIFY sectionRoleChanged)
     Q_PROPERTY(QString sizeRole READ sizeRole WRITE setSizeRole NOTIFY sizeRoleChanged)
+    Q_PROPERTY(QString ratioSourceRole READ ratioSourceRole WRITE setRatioSourceRole NOTIFY ratioSourceRoleChanged)
+    Q_PROPERTY(QString tileRole READ tileRole WRITE setTileRole NOTIFY tileRoleChanged)
     Q_PROPERTY(qreal idealHeight READ idealHeight WRITE setIdealHeight NOTIFY idealHeightChanged)
     Q_PROPERTY(qreal minHeight READ minHeight WRITE setMinHeight NOTIFY minHeightChanged)
     Q_PROPERTY(qreal maxHeight READ maxHeight WRITE setMaxHeight NOTIFY maxHeightChanged)
+    Q_PROPERTY(LayoutMode layoutMode READ layoutMode WRITE setLayoutMode NOTIFY layoutModeChanged)
+    Q_PROPERTY(qreal cellRatio READ cellRatio WRITE setCellRatio NOTIFY cellRatioChanged)
     Q_PROPERTY(qreal cacheBuffer READ cacheBuffer WRITE setCacheBuffer NOTIFY cacheBufferChanged)
+    Q_PROPERTY(qreal retainBuffer READ retainBuffer WRITE setRetainBuffer NOTIFY retainBufferChanged)
     Q_PROPERTY(int currentIndex READ currentIndex WRITE setCurrentIndex NOTIFY currentIndexChanged)
+    Q_PROPERTY(int selectedCount READ selectedCount NOTIFY selectionChanged)
     Q_PROPERTY(QQuickItem* currentItem READ currentItem NOTIFY currentItemChanged)
     Q_PROPERTY(QQuickItem* currentSection READ currentSection NOTIFY currentSectionChanged)
     Q_PROPERTY(qreal verticalSpacing READ verticalSpacing WRITE setVerticalSpacing NOTIFY verticalSpacingChanged)
     Q_PROPERTY(qreal horizontalSpacing READ horizontalSpacing WRITE setHorizontalSpacing NOTIFY horizontalSpacingChanged)
     Q_PROPERTY(qreal sectionSpacing READ sectionSpacing WRITE setSectionSpacing NOTIFY sectionSpacingChanged)
+    Q_PROPERTY(int updateLatency READ updateLatency WRITE setUpdateLatency NOTIFY updateLatencyChanged)
+    Q_PROPERTY(int updateBudget READ updateBudget WRITE setUpdateBudget NOTIFY updateBudgetChanged)
+    Q_PROPERTY(int memoryBudget READ memoryBudget WRITE setMemoryBudget NOTIFY memoryBudgetChanged)
+    Q_PROPERTY(FlexViewStats* stats READ stats CONSTANT)
 
 public:
+    enum PositionMode
+    {
+        Beginning,
+        Center,
+        End,
+        Contain
+    };
+    Q_ENUM(PositionMode)
+
+    enum TrimLevel
+    {
+        // Drop released delegate entries, and compact sections outside of the cache area
+        TrimCaches,
+        // Also release delegates and section items outside of the viewport, and compact
+        // sections that aren't visible
+        TrimOffscreen,
+        // Also free spare capacity in what remains
+        TrimAll
+    };
+    Q_ENUM(TrimLevel)
+
+    enum LayoutMode
+    {
+        // Rows are filled edge to edge, with breaks chosen for heights closest to idealHeight
+        JustifiedLayout,
+        // Every item gets a cell of cellRatio, as many to a row as fit at about idealHeight.
+        // Item ratios aren't read at all.
+        GridLayout
+    };
+    Q_ENUM(LayoutMode)
+
     FlexView(QQuickItem *parent = nullptr);
     virtual ~FlexView();
 
@@ -46,6 +90,20 @@ public:
     QString sizeRole() const;
     void setSizeRole(const QString &role);
 
+    // Role with a local file URL or path for rows that have no sizeRole value. Their ratio
+    // is read from the image header in the background, and a placeholder is used until then.
+    // With the flexthumb image provider, thumbnails for these files are also prefetched
+    // ahead of the viewport.
+    QString ratioSourceRole() const;
+    void setRatioSourceRole(const QString &role);
+
+    // Role with a local image file URL or path to draw each item as a plain image tile.
+    // When it's set, sections draw their rows with the flexthumb image provider instead of
+    // creating delegates, and only the current item has a delegate. Clicks on tiles are
+    // reported with tileClicked.
+    QString tileRole() const;
+    void setTileRole(const QString &role);
+
     qreal idealHeight() const;
     void setIdealHeight(qreal idealHeight);
     qreal minHeight() const;
@@ -53,15 +111,53 @@ public:
     qreal maxHeight() const;
     void setMaxHeight(qreal maxHeight);
 
+    LayoutMode layoutMode() const;
+    void setLayoutMode(LayoutMode mode);
+    // Width over height of cells in GridLayout
+    qreal cellRatio() const;
+    void setCellRatio(qreal ratio);
+
     qreal cacheBuffer() const;
     void setCacheBuffer(qreal cacheBuffer);
+    // Sections further than retainBuffer beyond the cache area drop their sizes and rows,
+    // which are loaded again when they come back; negative keeps everything.
+    qreal retainBuffer() const;
+    void setRetainBuffer(qreal retainBuffer);
 
     int currentIndex() const;
     void setCurrentIndex(int index);
+    // Move the current index by rows or by pages of the view's height, keeping the same x
+    // across moves. Only the sections they land in are laid out, and the view isn't
+    // scrolled; use positionViewAtIndex to follow the current index.
     Q_INVOKABLE bool moveCurrentRow(int delta);
+    Q_INVOKABLE bool movePage(int delta);
+    Q_INVOKABLE bool moveToStart();
+    Q_INVOKABLE bool moveToEnd();
+    // Scroll to index without laying out anything before its section; contentY is corrected
+    // as heights above it become known, until the view is moved by something else.
+    Q_INVOKABLE void positionViewAtIndex(int index, PositionMode mode);
+    // Items intersecting rect in content coordinates, as a list of [first, last] index
+    // ranges in order. Sections partly inside rect are laid out if they aren't already.
+    Q_INVOKABLE QVariantList indicesInRect(const QRectF &rect);
+    // The geometry of index in content coordinates, or an empty rect if it's out of range
+    Q_INVOKABLE QRectF geometryOf(int index);
     QQuickItem *currentItem() const;
     QQuickItem *currentSection() const;
 
+    // Selection is kept by the view as ranges of indices, which follow rows through model
+    // changes. Delegates read it from the FlexView.selected attached property, which is
+    // notified only when it changes for that delegate.
+    int selectedCount() const;
+    Q_INVOKABLE bool isSelected(int index) const;
+    // Select or deselect indices from first to last, or only first if last is -1. These
+    // warn and do nothing when called during layout, as from a delegate being created.
+    Q_INVOKABLE void select(int first, int last = -1);
+    Q_INVOKABLE void deselect(int first, int last = -1);
+    Q_INVOKABLE void selectAll();
+    Q_INVOKABLE void clearSelection();
+    // Selected indices as a list of [first, last] ranges in order
+    Q_INVOKABLE QVariantList selectedRanges() const;
+
     qreal verticalSpacing() const;
     void setVerticalSpacing(qreal spacing);
     qreal horizontalSpacing() const;
@@ -69,22 +165,63 @@ public:
     qreal sectionSpacing() const;
     void setSectionSpacing(qreal spacing);
 
+    // Model changes are applied at most updateLatency ms after they arrive, unless a
+    // layout happens first; 0 applies them in the next polish.
+    int updateLatency() const;
+    void setUpdateLatency(int msecs);
+    // Layout of changed sections that aren't visible stops after updateBudget ms in a
+    // frame, and continues in later frames; 0 is unlimited.
+    int updateBudget() const;
+    void setUpdateBudget(int msecs);
+    // After a layout pass that ends with memoryUsage over memoryBudget KiB, released
+    // delegate entries are dropped and sections outside of the cache area are compacted;
+    // 0 is unlimited.
+    int memoryBudget() const;
+    void setMemoryBudget(int kbytes);
+
+    // Estimated count and bytes held by the view for each category, and the total bytes.
+    // Delegates are counted at a fixed estimate per item.
+    Q_INVOKABLE QVariantMap memoryUsage() const;
+    // Release memory in response to memory pressure. Anything released is created or loaded
+    // again as the view needs it.
+    Q_INVOKABLE void trimMemory(TrimLevel level);
+
+    FlexViewStats *stats() const;
+
+    static FlexViewAttached *qmlAttachedProperties(QObject *obj);
+
+    // Content starts at originY, which moves to keep visible content in place when the
+    // height of sections above it changes
+    virtual qreal originY() const override;
+    virtual qreal minYExtent() const override;
+    virtual qreal maxYExtent() const override;
+
 signals:
     void modelChanged();
     void delegateChanged();
     void sectionChanged();
     void sectionRoleChanged();
     void sizeRoleChanged();
+    void ratioSourceRoleChanged();
+    void tileRoleChanged();
+    void tileClicked(int index);
     void idealHeightChanged();
     void minHeightChanged();
     void maxHeightChanged();
+    void layoutModeChanged();
+    void cellRatioChanged();
     void cacheBufferChanged();
+    void retainBufferChanged();
     void currentIndexChanged();
+    void selectionChanged();
     void currentItemChanged();
     void currentSectionChanged();
     void verticalSpacingChanged();
     void horizontalSpacingChanged();
     void sectionSpacingChanged();
+    void updateLatencyChanged();
+    void updateBudgetChanged();
+    void memoryBudgetChanged();
 
 protected:
     virtual void componentComplete() override;
@@ -97,3 +234,35 @@ private:
 
     FlexViewPrivate *d = nullptr;
 };
+QML_DECLARE_TYPEINFO(FlexView, QML_HAS_ATTACHED_PROPERTIES)
+
+// Attached to items in a delegate as FlexView.view and FlexView.selected. Setting selected
+// selects or deselects the delegate's index.
+class FlexViewAttached : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(FlexView* view READ view CONSTANT)
+    Q_PROPERTY(bool selected READ isSelected WRITE setSelected NOTIFY selectedChanged)
+
+public:
+    FlexViewAttached(FlexView *view, QObject *parent);
+    virtual ~FlexViewAttached();
+
+    FlexView *view() const { return m_view; }
+    // The index of the delegate, or -1 outside of one
+    int index() const;
+
+    bool isSelected() const { return m_selected; }
+    void setSelected(bool selected);
+
+    // Non-QML API
+    void updateSelected(bool selected);
+
+signals:
+    void selectedChanged();
+
+private:
+    QPointer<FlexView> m_view;
+    bool m_selected = false;
+};
@@ -2,13 +2,44 @@
 
 #include "flexview.h"
 #include "delegatemanager.h"
+#include "flexstats.h"
+#include "fenwicktree.h"
+#include "flexselection.h"
 #include <QPointer>
+#include <QSet>
+#include <QTimer>
+#include <QPersistentModelIndex>
 #include <QLoggingCategory>
 #include <QtQml/private/qqmlchangeset_p.h>
 #include <QtQml/private/qqmlguard_p.h>
 #include <QtQuick/private/qquickitemchangelistener_p.h>
+#include <map>
 
 class FlexSection;
+class FlexRatioProvider;
+class FlexListModel;
+struct ModelData;
+
+// Estimates of memory held by a view, by category
+struct FlexMemoryUsage
+{
+    struct Category
+    {
+        int count = 0;
+        qint64 bytes = 0;
+    };
+
+    Category liveDelegates;
+    Category releasedDelegates;
+    Category sectionItems;
+    Category sections;
+    Category itemData;
+    Category rows;
+    Category caches;
+
+    qint64 total() const;
+    QVariantMap toMap() const;
+};
 
 class FlexViewPrivate : public QObject, public QQuickItemChangeListener
 {
@@ -17,42 +48,161 @@ class FlexViewPrivate : public QObject, public QQuickItemChangeListener
 public:
     FlexView * const q;
 
+    FlexViewStats * const stats;
+
     QAbstractItemModel *model = nullptr;
+    // Set if model is a FlexListModel, which is drained before each layout
+    FlexListModel *listModel = nullptr;
     QQmlChangeSet pendingChanges;
     int moveId = 0;
+    // Data changes that arrived while rows were inserted or removed, as model indices that
+    // are shifted by later changes. Delegates are notified when pendingChanges are applied
+    // and their indices match the model again.
+    struct PendingData
+    {
+        int first;
+        int last;
+        QVector<int> roles;
+    };
+    QVector<PendingData> pendingData;
 
     QQmlGuard<QQmlComponent> delegate;
     DelegateManager items;
 
     QQmlGuard<QQmlComponent> sectionDelegate;
+    // Sections must be added and removed with insertSection and removeSection, which keep
+    // sectionCounts and sectionHeights in sync. viewStart of every section is derived from
+    // sectionCounts, and its y from sectionHeights, which has each section's height() plus
+    // sectionSpacing. Adding or removing a section renumbers and rebuilds them from its
+    // position on; only a change to properties every section depends on rebuilds them all.
     QList<FlexSection*> sections;
+    FenwickTree<int> sectionCounts;
+    FenwickTree<qreal> sectionHeights;
+    bool sectionIndexDirty = false;
+    // Sections that may be empty or have the same value as the section before them, for
+    // mergeSections
+    QSet<FlexSection*> mergeCandidates;
+    int sectionGeneration = 0;
+    // Properties that every section's height depends on, as of the last layout
+    QVector<qreal> sectionProperties;
+    // Estimates for sections that aren't laid out: the sum and number of sizes in laid
+    // out sections, and section item height beyond the content from the last section item
+    qreal ratioSum = 0;
+    qint64 ratioCount = 0;
+    qreal sectionHeaderHeight = 0;
     QString sectionRole;
     int sectionRoleIdx = -1;
     QString sizeRole;
     int sizeRoleIdx = -1;
+    QString ratioSourceRole;
+    int ratioSourceRoleIdx = -1;
+    FlexRatioProvider *ratioProvider = nullptr;
+    QString tileRole;
+    int tileRoleIdx = -1;
 
     qreal idealHeight = 0;
     qreal minHeight = 0;
     qreal maxHeight = 0;
+    FlexView::LayoutMode layoutMode = FlexView::JustifiedLayout;
+    qreal cellRatio = 1;
     qreal cacheBuffer = 0;
+    qreal retainBuffer = 10000;
+    // Sections that have loaded sizes since they were last compact
+    QList<QPointer<FlexSection>> loadedSections;
 
     int currentIndex = -1;
     QPointer<FlexSection> currentSection;
     qreal moveRowTargetX = -1;
 
+    FlexSelection selection;
+    // Attached objects of delegates, which are told when their index's selection changes
+    QVector<FlexViewAttached*> attached;
+
+    // Loaded rows and the current row between layoutAboutToBeChanged and layoutChanged
+    QVector<QPersistentModelIndex> persistentRows;
+    QPersistentModelIndex persistentCurrent;
+    // Selected rows between layoutAboutToBeChanged and layoutChanged, unless every row is
+    // selected
+    QVector<QPersistentModelIndex> persistentSelection;
+
     qreal vSpacing = 0;
     qreal hSpacing = 0;
     qreal sectionSpacing = 0;
 
     bool inLayout = false;
+    // Set while layout drains listModel, whose inserts it applies right after
+    bool draining = false;
+
+    // Anything but contentY changing must invalidate the layout for the next polish to do a
+    // full pass. Otherwise only the sections that had items in the last full pass, from
+    // activeFirst to activeLast and between activeTop and activeBottom, are updated.
+    // activeSections are all sections that may have an item, to release when they're no
+    // longer near the viewport.
+    bool layoutDirty = true;
+    QRectF laidOutArea;
+    QList<QPointer<FlexSection>> activeSections;
+    int activeFirst = -1;
+    int activeLast = -1;
+    qreal activeTop = 0;
+    qreal activeBottom = 0;
+
+    // Sections are positioned from contentOrigin. It moves when heights change above the
+    // first visible row, anchorRow, to keep that row at anchorY in the content.
+    qreal contentOrigin = 0;
+    QPersistentModelIndex anchorRow;
+    qreal anchorY = 0;
+
+    // Target of the last positionViewAtIndex, while it's still being corrected
+    int positionIndex = -1;
+    FlexView::PositionMode positionMode = FlexView::Beginning;
+
+    int updateLatency = 0;
+    int updateBudget = 0;
+    QTimer updateTimer;
+
+    // Top of the visible area at the last prefetch, for the direction of scrolling
+    qreal prefetchTop = 0;
+
+    int memoryBudget = 0;
+    // Set for a pass that lays out without the cache buffer, from trimMemory
+    bool trimCache = false;
 
     FlexViewPrivate(FlexView *q);
     virtual ~FlexViewPrivate();
 
+    static FlexViewPrivate *get(FlexView *view) { return view->d; }
+
     void layout();
-    void updateContentHeight(qreal layoutHeight);
+    bool layoutViewport(const QRectF &visibleArea, const QRectF &cacheArea);
+    bool layoutSectionItem(FlexSection *section, qreal y, const QRectF &visibleArea, const QRectF &cacheArea);
+    void invalidateLayout();
+    void applySectionProperties(FlexSection *section);
+    void updateSectionProperties();
+    void positionViewAtIndex(int index, FlexView::PositionMode mode);
+    QVector<QPair<int, int>> indicesInRect(const QRectF &rect);
+    QRectF geometryOf(int index);
+    bool layoutSection(FlexSection *section);
+    int indexAtRowOffset(int s, int row, int delta, qreal x, bool &laidOut);
+    int indexNearest(const QPointF &pos);
+    bool isActive(FlexSection *section) const;
+    void correctPosition();
+    void setContentOrigin(qreal origin);
+    void updateAnchor(const QRectF &visibleArea);
+    qreal anchorDelta();
+    qreal contentYFor(const QRectF &geometry, FlexView::PositionMode mode) const;
+    void updateContentHeight();
     bool applyPendingChanges();
-    void validateSections();
+    void scheduleUpdate();
+    QVector<QPair<QString, int>> sectionRuns(int index, int count);
+    void replaceRows(int s, int first, int removed, const QVector<QPair<QString, int>> &runs);
+    void restoreMoved(int s, const QQmlChangeSet::Change &insert, std::map<std::pair<int, int>, ModelData> &moved);
+    void mergeSections();
+    void mergeSectionAt(int s);
+    void updateCurrentSection(int oldCurrentIndex, QPointer<FlexSection> oldCurrentSection);
+    void updateSelected(int first, int last);
+    void restoreSelection(const QVector<QPersistentModelIndex> &selected);
+    bool validateSections();
+    bool validateLayout();
     bool refill();
     void clear();
 
@@ -60,18 +210,44 @@ public:
 
     QString sectionValue(int index);
     qreal indexFlexRatio(int index);
+    qreal modelFlexRatio(int index);
+    qreal sourceFlexRatio(int index);
+    QString sourcePath(int index);
+    QString tilePath(int index);
+    QString localFilePath(int index, const QString &role, int &roleIdx);
+    void prefetchThumbnails(const QRectF &visibleArea, const QRectF &cacheArea);
 
     virtual void itemGeometryChanged(QQuickItem *item, QQuickGeometryChange change, const QRectF &oldGeometry) override;
 
-    FlexSection *sectionOf(int index) const;
+    FlexSection *sectionOf(int index);
+    int sectionIndexAt(int index);
+    int loadedCount();
+
+    void insertSection(int at, FlexSection *section);
+    void removeSection(int at);
+    void sectionCountChanged(FlexSection *section, int delta);
+    void sectionHeightChanged(FlexSection *section, qreal delta);
+    void sectionRatiosChanged(FlexSection *section, qreal sumDelta, int countDelta);
+    void sectionLoaded(FlexSection *section);
+    void compactSections(const QRectF &area, qreal retain);
+    FlexMemoryUsage memoryUsage() const;
+    void enforceMemoryBudget(const QRectF &cacheArea);
+    void trimMemory(FlexView::TrimLevel level);
+    void updateSectionIndex();
+    qreal sectionY(int s);
+    int sectionAtY(qreal y);
+    qreal estimateRowsHeight(int count) const;
 
 public slots:
     void rowsInserted(const QModelIndex &parent, int first, int last);
     void rowsRemoved(const QModelIndex &parent, int first, int last);
     void rowsMoved(const QModelIndex &parent, int start, int end, const QModelIndex &destination, int row);
     void dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles);
+    void shiftPendingData(int index, int count);
+    void layoutAboutToBeChanged();
     void layoutChanged();
     void modelReset();
+    void ratiosLoaded(const QVector<int> &rows);
 };
 
 Q_DECLARE_LOGGING_CATEGORY(lcView)
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <QtGlobal>
+#include <algorithm>
+#include <vector>
+
+// GapBuffer is a sequence stored with a gap at the last edit position. Inserting or
+// removing at the gap is constant time, and moving the gap costs only the distance it
+// moves, so runs of edits in one place (like prepending photos to a section, or removing
+// from its head) stay cheap however large the sequence is. Inserted elements are
+// value-initialized, and removed elements are reset to release what they hold.
+template<typename T>
+class GapBuffer
+{
+public:
+    int size() const { return int(m_buffer.size()) - gapSize(); }
+    bool isEmpty() const { return size() == 0; }
+    // Allocated elements, including the gap
+    int capacity() const { return int(m_buffer.size()); }
+
+    T &operator[](int i)
+    {
+        Q_ASSERT(i >= 0 && i < size());
+        return m_buffer[i < m_gapStart ? i : i + gapSize()];
+    }
+
+    const T &operator[](int i) const
+    {
+        Q_ASSERT(i >= 0 && i < size());
+        return m_buffer[i < m_gapStart ? i : i + gapSize()];
+    }
+
+    void insert(int i, int count)
+    {
+        Q_ASSERT(i >= 0 && i <= size());
+        Q_ASSERT(count >= 0);
+        reserveGap(count);
+        moveGap(i);
+        for (int j = m_gapStart; j < m_gapStart + count; j++)
+            m_buffer[j] = T();
+        m_gapStart += count;
+    }
+
+    void remove(int i, int count)
+    {
+        Q_ASSERT(i >= 0 && count >= 0 && i + count <= size());
+        moveGap(i);
+        for (int j = m_gapEnd; j < m_gapEnd + count; j++)
+            m_buffer[j] = T();
+        m_gapEnd += count;
+    }
+
+    void clear()
+    {
+        m_buffer.clear();
+        m_buffer.shrink_to_fit();
+        m_gapStart = m_gapEnd = 0;
+    }
+
+    // Release the gap by moving it to the end and reallocating without it
+    void squeeze()
+    {
+        moveGap(size());
+        m_buffer.resize(m_gapStart);
+        m_buffer.shrink_to_fit();
+        m_gapEnd = m_gapStart;
+    }
+
+private:
+    std::vector<T> m_buffer;
+    int m_gapStart = 0;
+    int m_gapEnd = 0;
+
+    int gapSize() const { return m_gapEnd - m_gapStart; }
+
+    void moveGap(int i)
+    {
+        auto b = m_buffer.begin();
+        if (i < m_gapStart)
+            std::move_backward(b + i, b + m_gapStart, b + m_gapEnd);
+        else if (i > m_gapStart)
+            std::move(b + m_gapEnd, b + m_gapEnd + (i - m_gapStart), b + m_gapStart);
+        m_gapEnd += i - m_gapStart;
+        m_gapStart = i;
+    }
+
+    void reserveGap(int count)
+    {
+        if (gapSize() >= count)
+            return;
+
+        int capacity = std::max({size() + count, 2 * int(m_buffer.size()), 16});
+        int tail = int(m_buffer.size()) - m_gapEnd;
+        std::vector<T> buffer(capacity);
+        std::move(m_buffer.begin(), m_buffer.begin() + m_gapStart, buffer.begin());
+        std::move(m_buffer.begin() + m_gapEnd, m_buffer.end(), buffer.end() - tail);
+        m_buffer.swap(buffer);
+        m_gapEnd = capacity - tail;
+    }
+};
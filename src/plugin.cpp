@@ -1,11 +1,23 @@
 #include "plugin.h"
 #include "flexview.h"
 #include "flexsection.h"
+#include "flexlistmodel.h"
+#include "flexstats.h"
+#include "flexthumbnailprovider.h"
 #include <QtQml>
 
 void QuickViewsPlugin::registerTypes(const char *uri)
 {
     // @uri Crimson.Views
     qmlRegisterType<FlexView>(uri, 1, 0, "FlexView");
+    qmlRegisterType<FlexListModel>(uri, 1, 0, "FlexListModel");
     qmlRegisterUncreatableType<FlexSection>(uri, 1, 0, "FlexSection", "attached type");
+    qmlRegisterUncreatableType<FlexViewStats>(uri, 1, 0, "FlexViewStats", "FlexView.stats");
+}
+
+void QuickViewsPlugin::initializeEngine(QQmlEngine *engine, const char *uri)
+{
+    Q_UNUSED(uri);
+    if (!engine->imageProvider(FlexThumbnailProvider::id()))
+        engine->addImageProvider(FlexThumbnailProvider::id(), new FlexThumbnailProvider);
 }
@@ -8,4 +8,5 @@ class QuickViewsPlugin : public QQmlExtensionPlugin
 
 public:
     void registerTypes(const char *uri) override;
+    void initializeEngine(QQmlEngine *engine, const char *uri) override;
 };
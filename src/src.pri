@@ -0,0 +1,31 @@
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/plugin.cpp \
+    $$PWD/flexview.cpp \
+    $$PWD/flexsection.cpp \
+    $$PWD/flexlayoutengine.cpp \
+    $$PWD/flexlistmodel.cpp \
+    $$PWD/flexratioprovider.cpp \
+    $$PWD/flexthumbnailprovider.cpp \
+    $$PWD/flextilelayer.cpp \
+    $$PWD/delegatemanager.cpp \
+    $$PWD/flexstats.cpp \
+    $$PWD/flextrace.cpp
+
+HEADERS += \
+    $$PWD/plugin.h \
+    $$PWD/flexview.h \
+    $$PWD/flexview_p.h \
+    $$PWD/flexsection.h \
+    $$PWD/flexlayoutengine.h \
+    $$PWD/flexlistmodel.h \
+    $$PWD/flexratioprovider.h \
+    $$PWD/flexselection.h \
+    $$PWD/flexthumbnailprovider.h \
+    $$PWD/flextilelayer.h \
+    $$PWD/delegatemanager.h \
+    $$PWD/flexstats.h \
+    $$PWD/flextrace.h \
+    $$PWD/gapbuffer.h \
+    $$PWD/fenwicktree.h